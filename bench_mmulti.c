@@ -0,0 +1,385 @@
+//Benchmarks the sequential multiplication routines on a single process.
+//Every routine is run over a sweep of dimensions, leaf cutoffs, leaf
+//kernels and thread counts: WARMUP untimed runs, then REPS timed ones.
+//One line per configuration is printed, as CSV or JSON, with the median
+//and best times, GOPS, the memory high-water mark of the process during the
+//configuration and the parallel efficiency against the first thread count.
+//Cutoff, kernel and cache blocking default to the tuning profile written by
+//tune_mmulti, when there is one.
+//Example use:
+//./bench_mmulti 1024
+//./bench_mmulti -n 512,1024,2048 -c 64,128,256 -r 7 > seq.csv
+//./bench_mmulti -n 2048 -R mmulti,morton -k avx2 -t 1,2,4,8 -j > threads.json
+//Distributed runs are swept by benchsweep.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "mmulti.h"
+
+#define DEFAULT_DIM (1<<10)
+
+//Default number of untimed and timed runs of every configuration.
+#define DEFAULT_WARMUP 1
+#define DEFAULT_REPS 5
+
+//Most values a swept setting may take.
+#define MAX_SWEEP 32
+
+//Routines benchmarked, and the settings each of them depends on.
+enum { R_NAIVE, R_BASE2, R_MMULTI, R_PARALLEL, R_STRASSEN, R_MORTON, R_TILED,
+       R_PLAN, R_COUNT };
+char *routine_names[R_COUNT] = {"naive", "mmulti_2x2", "mmulti", "parallel",
+                                "strassen", "morton", "tiled", "plan"};
+int uses_cutoff[R_COUNT] = {0, 0, 1, 1, 1, 1, 0, 0};
+int uses_kernel[R_COUNT] = {0, 0, 1, 1, 1, 1, 1, 1};
+int uses_threads[R_COUNT] = {0, 0, 0, 1, 0, 1, 0, 1};
+
+//Values of every swept setting.
+int dims[MAX_SWEEP], n_dims;
+int cutoffs[MAX_SWEEP], n_cutoffs;
+int kernels[MAX_SWEEP], n_kernels;
+int threads[MAX_SWEEP], n_threads;
+int routines[R_COUNT], n_routines;
+
+int warmup = DEFAULT_WARMUP;
+int reps = DEFAULT_REPS;
+int json = 0;
+int rows_printed = 0;
+
+//Operands, reference result given by naive_multi(), result, and their
+//Morton copies.
+elem *A, *B, *R, *C;
+elem *Az, *Bz, *Cz;
+
+//Plan of the configuration, when benchmarking mm_execute().
+mm_plan *plan;
+
+
+double wall_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+//Counts elements of C that differ from the reference result R.
+int count_mismatches(elem *R, elem *C, int size) {
+    int i;
+    int bad = 0;
+    for(i=0; i<size*size; i++) {
+        if(R[i]!=C[i]) {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+//Index of name in names, or -1.
+int find_name(char **names, int n, const char *name) {
+    int i;
+    for(i=0; i<n; i++) {
+        if(strcmp(names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//Reads a comma separated list of positive integers into v.
+//Returns the number of values, or -1 if the list is invalid.
+int parse_list(char *s, int *v) {
+    int n = 0;
+    char *tok;
+    for(tok=strtok(s, ","); tok!=NULL; tok=strtok(NULL, ",")) {
+        if(n == MAX_SWEEP || (v[n] = atoi(tok)) <= 0) {
+            return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+//Same for a list of names, stored as their index in names.
+int parse_names(char *s, int *v, char **names, int count, int max) {
+    int n = 0;
+    char *tok;
+    for(tok=strtok(s, ","); tok!=NULL; tok=strtok(NULL, ",")) {
+        if(n == max || (v[n] = find_name(names, count, tok)) < 0) {
+            return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+void usage(char *prog) {
+    printf("Usage: %s [-n DIMS] [-c CUTOFFS] [-k KERNELS] [-t THREADS]\n"
+           "          [-R ROUTINES] [-w WARMUP] [-r REPS] [-j] [DIM]\n"
+           "Lists are comma separated. Routines: naive, mmulti_2x2, mmulti,\n"
+           "parallel, strassen, morton, tiled, plan. Kernels: those of kernel_name().\n",
+           prog);
+    exit(1);
+}
+
+
+//Runs routine r once on the size x size operands.
+void run(int r, int size) {
+    switch(r) {
+    case R_NAIVE:
+        naive_multi(A, B, C, size);
+        break;
+    case R_BASE2:
+    case R_MMULTI:
+        mmulti(A, B, 0, 0, 0, 0, C, size, size);
+        break;
+    case R_PARALLEL:
+        parallel_multi(A, size, B, size, C, size, size);
+        break;
+    case R_STRASSEN:
+        mmulti_strassen = 1;
+        mmulti(A, B, 0, 0, 0, 0, C, size, size);
+        mmulti_strassen = 0;
+        break;
+    case R_MORTON:
+        //Conversions included: that is what a caller pays.
+        to_morton(A, size, Az, size);
+        to_morton(B, size, Bz, size);
+        morton_multi(Az, Bz, Cz, size);
+        from_morton(Cz, C, size, size);
+        break;
+    case R_TILED:
+        tiled_multi(A, size, B, size, C, size, size, size, size);
+        break;
+    case R_PLAN:
+        mm_execute(plan, A, B, C);
+        break;
+    }
+}
+
+//Times WARMUP + REPS runs of routine r with the current settings and
+//prints the line of the configuration. t_base is the median time of the
+//same configuration on base_threads threads, or 0 if this is it.
+//Returns the median time.
+double measure(int r, int size, int cutoff, int kernel, int n_thr,
+               double t_base, int base_threads) {
+    double times[MAX_SWEEP*4];
+    double t, median, ops, eff;
+    int i, bad;
+    long peak;
+    int n = (reps < MAX_SWEEP*4) ? reps : MAX_SWEEP*4;
+
+    mem_peak_reset();
+    //Set up once, out of the timed runs: that is what a caller looping on
+    //the same shapes pays.
+    if(r == R_PLAN) {
+        plan = mm_plan_create(size, size, size, ELEM_TYPE, MPI_COMM_NULL, MM_THREADS);
+    }
+    for(i=0; i<warmup; i++) {
+        run(r, size);
+    }
+    for(i=0; i<n; i++) {
+        t = wall_time();
+        run(r, size);
+        times[i] = wall_time()-t;
+    }
+    peak = mem_peak_kib();
+    bad = count_mismatches(R, C, size);
+    if(r == R_PLAN) {
+        mm_plan_destroy(plan);
+    }
+    //The workspace of a configuration is not left over for the next one.
+    ws_free();
+
+    qsort(times, n, sizeof(double), compare_doubles);
+    median = (n%2) ? times[n/2] : (times[n/2-1] + times[n/2])/2;
+    ops = 2.0*size*size*(double)size;
+    eff = (t_base > 0) ? t_base*base_threads/(median*n_thr) : 1.0;
+
+    if(json) {
+        printf("%s  {\"routine\": \"%s\", \"elem\": \"%s\", \"dim\": %d, "
+               "\"cutoff\": %d, \"kernel\": \"%s\", \"threads\": %d, "
+               "\"reps\": %d, \"median_s\": %.6f, \"min_s\": %.6f, "
+               "\"gops\": %.3f, \"peak_kib\": %ld, \"efficiency\": %.3f, "
+               "\"ok\": %s}",
+               rows_printed ? ",\n" : "", routine_names[r], ELEM_NAME, size,
+               cutoff, kernel < 0 ? "-" : kernel_name(kernel), n_thr, n, median, times[0],
+               ops/median*1e-9, peak, eff, bad ? "false" : "true");
+    } else {
+        printf("%s,%s,%d,%d,%s,%d,%d,%.6f,%.6f,%.3f,%ld,%.3f,%s\n",
+               routine_names[r], ELEM_NAME, size, cutoff,
+               kernel < 0 ? "-" : kernel_name(kernel),
+               n_thr, n, median, times[0], ops/median*1e-9, peak, eff,
+               bad ? "WRONG" : "ok");
+    }
+    fflush(stdout);
+    rows_printed++;
+    return median;
+}
+
+//Every configuration of routine r on size x size matrices. Settings the
+//routine does not depend on are left at their first value, and reported as
+//0 (cutoff) or - (kernel).
+void sweep(int r, int size) {
+    int ci, ki, ti;
+    int n_c = uses_cutoff[r] ? n_cutoffs : 1;
+    int n_k = uses_kernel[r] ? n_kernels : 1;
+    int n_t = uses_threads[r] ? n_threads : 1;
+    int n_thr;
+    double t, t_base;
+
+    for(ci=0; ci<n_c; ci++) {
+        //mmulti_2x2 is the original recursion all the way down to 2x2.
+        mmulti_cutoff = (r == R_BASE2) ? 1 : cutoffs[ci];
+        for(ki=0; ki<n_k; ki++) {
+            if(kernel_select(kernels[ki]) != 0) {
+                continue;
+            }
+            t_base = 0;
+            for(ti=0; ti<n_t; ti++) {
+                n_thr = uses_threads[r] ? threads[ti] : 1;
+#ifdef _OPENMP
+                omp_set_num_threads(n_thr);
+#endif
+                t = measure(r, size, uses_cutoff[r] ? mmulti_cutoff : 0,
+                            uses_kernel[r] ? kernels[ki] : -1, n_thr,
+                            t_base, threads[0]);
+                if(ti == 0) {
+                    t_base = t;
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    char *knames[KERNEL_COUNT];
+    int size;
+    int i, k, opt;
+
+    kernel_init();
+    for(k=0; k<KERNEL_COUNT; k++) {
+        knames[k] = kernel_name(k);
+    }
+    //Cutoff and cache blocking of the node, when it has been tuned.
+    if(config_load_profile(0) != 0) {
+        return 1;
+    }
+
+    //Defaults: one dimension, the default cutoff, every kernel this node
+    //supports, OMP_NUM_THREADS threads and every routine.
+    dims[0] = DEFAULT_DIM;
+    n_dims = 1;
+    cutoffs[0] = mmulti_cutoff;
+    n_cutoffs = 1;
+    n_kernels = 0;
+    for(k=0; k<KERNEL_COUNT; k++) {
+        if(kernel_supported(k)) {
+            kernels[n_kernels++] = k;
+        }
+    }
+#ifdef _OPENMP
+    threads[0] = omp_get_max_threads();
+#else
+    threads[0] = 1;
+#endif
+    n_threads = 1;
+    for(i=0; i<R_COUNT; i++) {
+        routines[i] = i;
+    }
+    n_routines = R_COUNT;
+
+    while((opt = getopt(argc, argv, "n:c:k:t:R:w:r:j")) != -1) {
+        switch(opt) {
+        case 'n':
+            n_dims = parse_list(optarg, dims);
+            break;
+        case 'c':
+            n_cutoffs = parse_list(optarg, cutoffs);
+            break;
+        case 'k':
+            n_kernels = parse_names(optarg, kernels, knames, KERNEL_COUNT, MAX_SWEEP);
+            break;
+        case 't':
+            n_threads = parse_list(optarg, threads);
+            break;
+        case 'R':
+            n_routines = parse_names(optarg, routines, routine_names, R_COUNT, R_COUNT);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+        if(n_dims < 0 || n_cutoffs < 0 || n_kernels <= 0 || n_threads < 0
+           || n_routines < 0 || warmup < 0 || reps <= 0) {
+            usage(argv[0]);
+        }
+    }
+    //A lone dimension is still accepted, as before the options existed.
+    if(optind < argc) {
+        dims[0] = atoi(argv[optind]);
+        n_dims = 1;
+    }
+    for(i=0; i<n_dims; i++) {
+        if(dims[i] < 2) {
+            printf("Dimension must be greater than 1.\n");
+            return 1;
+        }
+    }
+
+    if(json) {
+        printf("[\n");
+    } else {
+        printf("routine,elem,dim,cutoff,kernel,threads,reps,median_s,min_s,"
+               "gops,peak_kib,efficiency,check\n");
+    }
+
+    for(i=0; i<n_dims; i++) {
+        size = dims[i];
+        matrix_alloc(&A, size);
+        matrix_alloc(&B, size);
+        matrix_alloc(&R, size);
+        matrix_alloc(&C, size);
+        matrix_alloc(&Az, size);
+        matrix_alloc(&Bz, size);
+        matrix_alloc(&Cz, size);
+        matrix_init(A, size, 0);
+        matrix_init(B, size, 2);
+        naive_multi(A, B, R, size);
+
+        for(k=0; k<n_routines; k++) {
+            sweep(routines[k], size);
+        }
+
+        free(A);
+        free(B);
+        free(R);
+        free(C);
+        free(Az);
+        free(Bz);
+        free(Cz);
+    }
+
+    if(json) {
+        printf("\n]\n");
+    }
+    return 0;
+}
@@ -0,0 +1,597 @@
+/*
+Communication helpers shared by the tree drivers: transfer of operand blocks
+to the children and collection of the products they send back.
+
+Operand blocks are square windows of a larger row-major matrix. When their
+lines are not contiguous they are described by an MPI vector datatype, so
+MPI reads or writes them in place instead of going through a packed copy.
+
+Collection of the products sent back by the children of a dividing process:
+
+Every product expected from a child is reduced into one or more quadrants of
+the father's C. The first product landing on an empty quadrant is copied
+into it, every other one is added (or subtracted, for Strassen).
+
+A product going only to a quadrant nobody has written yet is received
+straight into that quadrant through a vector datatype, without a buffer nor
+a copy. The first such product declared for each quadrant is chosen; the
+others of the same quadrant are only reduced once it has arrived.
+
+Results travel in row panels (see result_panels()), each with its own tag,
+so the father reduces a panel while the next ones are still in flight, and
+a dividing child streams every panel of its own C to its father as soon as
+all the products falling in it have been reduced, without waiting for the
+rest of its C.
+
+Two modes are available:
+    - blocking: products are received one after the other, in the order
+      they were declared, through a single half size buffer. The panels of
+      the current product are still reduced as they arrive.
+    - non-blocking: a receive is posted for every child up front, into its
+      own buffer, and products are reduced in the order they complete. A
+      slow child then only delays its own quadrants, and the transfers can
+      progress while the father computes the piece it kept for itself.
+      This takes one half size buffer per child not received in place.
+
+Drivers built with PAIR_REDUCTION pair the children whose products only
+ever go to the same quadrant: the second of a pair sends its result to the
+first one, which adds it to its own with pair_reduce() and streams the sum
+to the father. Fathers then receive four quadrants instead of eight
+products, half the bytes, every one of them straight into place.
+
+Drivers built with RMA_RESULT skip the collection: the root exposes its C
+as an RMA window (result_window_open()) and every leaf adds its product
+straight into its place with MPI_Accumulate (result_accumulate()), under a
+passive target epoch, so products cross the network once instead of once
+per level and no process reduces them.
+
+Typical use:
+    collector col;
+    collect_init(&col, C, ldc, half, nonblocking);
+    p = collect_expect(&col, child1);
+    collect_target(&col, p, 0, 1);
+    ...
+    collect_forward(&col, father); //unless this is the root
+    collect_start(&col);
+    //own work
+    collect_finish(&col);
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mpi.h"
+#include "mmulti.h"
+
+
+//Datatype of an m x n block whose lines are ld elements apart.
+//Must be freed by the caller.
+static MPI_Datatype rect_type(int m, int n, int ld) {
+    MPI_Datatype t;
+    MPI_Type_vector(m, n, ld, MPI_ELEM, &t);
+    MPI_Type_commit(&t);
+    return t;
+}
+
+static MPI_Datatype block_type(int n, int ld) {
+    return rect_type(n, n, ld);
+}
+
+//Sends the n x n block X, whose lines are ldx elements apart, to dest.
+void send_block(const elem *X, int ldx, int n, int dest, int tag) {
+    double ts = trace_now();
+    if(ldx == n) {
+        MPI_Send((void *)X, n*n, MPI_ELEM, dest, tag, MPI_COMM_WORLD);
+    } else {
+        MPI_Datatype t = block_type(n, ldx);
+        MPI_Send((void *)X, 1, t, dest, tag, MPI_COMM_WORLD);
+        MPI_Type_free(&t);
+    }
+    trace_span(TRACE_SEND, ts, dest, (long)n*n*sizeof(elem));
+}
+
+//Receives an n x n block from source into X, whose lines are ldx elements
+//apart.
+void recv_block(elem *X, int ldx, int n, int source, int tag) {
+    recv_rect(X, ldx, n, n, source, tag);
+}
+
+//Receives an m x n block from source into X, whose lines are ldx elements
+//apart.
+void recv_rect(elem *X, int ldx, int m, int n, int source, int tag) {
+    MPI_Status st;
+    double ts = trace_now();
+    if(ldx == n) {
+        MPI_Recv(X, m*n, MPI_ELEM, source, tag, MPI_COMM_WORLD, &st);
+    } else {
+        MPI_Datatype t = rect_type(m, n, ldx);
+        MPI_Recv(X, 1, t, source, tag, MPI_COMM_WORLD, &st);
+        MPI_Type_free(&t);
+    }
+    trace_span(TRACE_RECV, ts, st.MPI_SOURCE, (long)m*n*sizeof(elem));
+}
+
+//Number of row panels an n x n result is sent in. Both ends of a transfer
+//work it out from n alone.
+int result_panels(int n) {
+    return (n%RESULT_PANELS == 0) ? RESULT_PANELS : 1;
+}
+
+//Sends the n x n result C, whose lines are ldc elements apart, to dest in
+//result_panels(n) row panels.
+void send_result(const elem *C, int ldc, int n, int dest) {
+    int j;
+    int panels = result_panels(n);
+    int rows = n/panels;
+    MPI_Datatype t = rect_type(rows, n, ldc);
+    double ts;
+    for(j=0; j<panels; j++) {
+        ts = trace_now();
+        MPI_Send((void *)&C[j*rows*ldc], 1, t, dest, RESULT_TAG + j,
+                 MPI_COMM_WORLD);
+        trace_span(TRACE_SEND, ts, dest, (long)rows*n*sizeof(elem));
+    }
+    MPI_Type_free(&t);
+}
+
+
+//====================================================================
+//Collection of the products
+
+//Prepares the collection of h x h products into the four quadrants of the
+//2h x 2h matrix C, whose lines are ldc elements apart.
+void collect_init(collector *col, elem *C, int ldc, int h, int nonblocking) {
+    memset(col, 0, sizeof(collector));
+    col->h = h;
+    col->ldc = ldc;
+    col->nonblocking = nonblocking;
+    col->panels = result_panels(h);
+    col->rows = h/col->panels;
+    col->dest = -1;
+    col->quad[0] = C;
+    col->quad[1] = C + h;
+    col->quad[2] = C + h*ldc;
+    col->quad[3] = C + h*ldc + h;
+}
+
+//Same as collect_init() for a C in Morton layout: its quadrants are
+//contiguous h x h blocks, and so is C when it is streamed to the father.
+void collect_init_morton(collector *col, elem *C, int h, int nonblocking) {
+    int q;
+    collect_init(col, C, h, h, nonblocking);
+    for(q=0; q<4; q++) {
+        col->quad[q] = C + (size_t)q*h*h;
+    }
+    col->morton = 1;
+}
+
+//Declares a product that will be sent by process source.
+//Returns its index, to be given to collect_target().
+int collect_expect(collector *col, int source) {
+    int p = col->n++;
+    if(p >= MAX_PRODUCTS) {
+        printf("too many products to collect!\n");
+        exit(1);
+    }
+    col->source[p] = source;
+    return p;
+}
+
+//Product p must be added to quadrant q (0=C11, 1=C12, 2=C21, 3=C22)
+//with the given sign. Since products may arrive in any order, negative
+//ones can only target quadrants marked with collect_filled().
+void collect_target(collector *col, int p, int q, int sign) {
+    int t = col->n_targets[p]++;
+    int j;
+    col->target[p][t] = q;
+    col->sign[p][t] = sign;
+    for(j=0; j<col->panels; j++) {
+        col->left[q][j]++;
+    }
+}
+
+//Tells the collector quadrant q holds a partial result, or will hold it by
+//the time collect_finish() is called.
+void collect_filled(collector *col, int q) {
+    int j;
+    for(j=0; j<col->panels; j++) {
+        col->filled[q][j] = 1;
+    }
+}
+
+//The whole 2h x 2h C is the result of this process, to be streamed to
+//process dest during collect_finish() as its panels are completed.
+void collect_forward(collector *col, int dest) {
+    col->dest = dest;
+}
+
+//Workspace taken between collect_start() and collect_finish(), n being
+//the number of products that are not received in place.
+size_t collect_workspace(int h, int n, int nonblocking) {
+    return (nonblocking ? n : (n > 0))*ws_round((size_t)h*h);
+}
+
+//Picks the products received straight into their quadrant: the first one
+//declared for each quadrant still empty, if it goes to that quadrant only
+//and is not subtracted.
+static void choose_in_place(collector *col) {
+    int p, t, j;
+    int seen[4] = {0, 0, 0, 0};
+    for(p=0; p<col->n; p++) {
+        int q = col->target[p][0];
+        if(col->n_targets[p] == 1 && col->sign[p][0] > 0
+           && !col->filled[q][0] && !seen[q]) {
+            col->in_place[p] = 1;
+            for(j=0; j<col->panels; j++) {
+                col->pending[q][j] = p+1;
+            }
+        }
+        for(t=0; t<col->n_targets[p]; t++) {
+            seen[col->target[p][t]] = 1;
+        }
+    }
+}
+
+//Posts the receive of panel j of product p, in place or into M.
+static void post_panel(collector *col, int p, int j, elem *M, MPI_Request *req) {
+    int rows = col->rows;
+    int h = col->h;
+    if(col->in_place[p]) {
+        MPI_Irecv(col->quad[col->target[p][0]] + j*rows*col->ldc, 1,
+                  col->panel_type, col->source[p], RESULT_TAG + j,
+                  MPI_COMM_WORLD, req);
+    } else {
+        MPI_Irecv(M + j*rows*h, rows*h, MPI_ELEM, col->source[p],
+                  RESULT_TAG + j, MPI_COMM_WORLD, req);
+    }
+}
+
+//In non-blocking mode, takes the receive buffers from the workspace arena
+//and posts every receive. The blocking mode only needs its buffer once
+//collect_finish() is called.
+void collect_start(collector *col) {
+    int p, t, j;
+    int h = col->h;
+    for(p=0; p<col->n; p++) {
+        for(t=0; t<col->n_targets[p]; t++) {
+            if(col->sign[p][t] < 0 && !col->filled[col->target[p][t]][0]) {
+                printf("product subtracted from an empty quadrant!\n");
+                exit(1);
+            }
+        }
+    }
+    choose_in_place(col);
+    col->panel_type = rect_type(col->rows, h, col->ldc);
+    if(!col->nonblocking) {
+        return;
+    }
+    col->mark = ws_mark();
+    for(p=0; p<col->n; p++) {
+        if(!col->in_place[p]) {
+            col->buffer[p] = ws_alloc((size_t)h*h);
+        }
+        for(j=0; j<col->panels; j++) {
+            post_panel(col, p, j, col->buffer[p],
+                       &col->request[p*col->panels + j]);
+        }
+    }
+}
+
+//forward_ready() for a C in Morton layout. Panel r of C is then the r-th
+//contiguous slice of it, which covers whole panels of one quadrant or, when
+//C goes in a single panel, all of them.
+static void forward_ready_morton(collector *col) {
+    int r, q, j;
+    size_t hh = (size_t)col->h*col->h;
+    int panels = result_panels(2*col->h);
+    size_t size = 4*hh/panels;
+    size_t quad_panel = hh/col->panels;
+    for(r=0; r<panels; r++) {
+        int ready = !col->sent[r];
+        for(q=0; q<4 && ready; q++) {
+            //Slice of quadrant q covered by panel r.
+            size_t first = (r*size > q*hh) ? r*size : q*hh;
+            size_t last = ((r+1)*size < (q+1)*hh) ? (r+1)*size : (q+1)*hh;
+            for(j=0; first<last && j<col->panels; j++) {
+                if(first - q*hh < (j+1)*quad_panel && j*quad_panel < last - q*hh
+                   && col->left[q][j]) {
+                    ready = 0;
+                }
+            }
+        }
+        if(ready) {
+            MPI_Isend(col->quad[0] + r*size, size, MPI_ELEM, col->dest,
+                      RESULT_TAG + r, MPI_COMM_WORLD, &col->fwd_request[r]);
+            col->sent[r] = 1;
+        }
+    }
+}
+
+//Streams to the father every panel of C that no product is still to be
+//reduced into and that was not sent yet.
+static void forward_ready(collector *col) {
+    int r, q, j;
+    int n = 2*col->h;
+    int panels = result_panels(n);
+    int rows = n/panels;
+    if(col->dest < 0) {
+        return;
+    }
+    if(col->morton) {
+        forward_ready_morton(col);
+        return;
+    }
+    for(r=0; r<panels; r++) {
+        int ready = !col->sent[r];
+        for(q=0; q<4 && ready; q++) {
+            //Lines of quadrant q covered by panel r.
+            int top = (q < 2) ? 0 : col->h;
+            int first = (r*rows > top) ? r*rows : top;
+            int last = ((r+1)*rows < top + col->h) ? (r+1)*rows : top + col->h;
+            for(j=(first-top)/col->rows; first<last && j<=(last-1-top)/col->rows; j++) {
+                if(col->left[q][j]) {
+                    ready = 0;
+                }
+            }
+        }
+        if(ready) {
+            if(col->fwd_type == MPI_DATATYPE_NULL) {
+                col->fwd_type = rect_type(rows, n, col->ldc);
+            }
+            MPI_Isend(col->quad[0] + r*rows*col->ldc, 1, col->fwd_type,
+                      col->dest, RESULT_TAG + r, MPI_COMM_WORLD,
+                      &col->fwd_request[r]);
+            col->sent[r] = 1;
+        }
+    }
+}
+
+//Records that panel j of the product received in place into quadrant q
+//has arrived.
+static void landed(collector *col, int q, int j) {
+    col->filled[q][j] = 1;
+    col->pending[q][j] = 0;
+    col->left[q][j]--;
+}
+
+//Reduces panel j of product p, held in M, into its quadrants.
+static void reduce_panel(collector *col, int p, int j, const elem *M) {
+    int t, i;
+    int h = col->h;
+    int ldc = col->ldc;
+    int rows = col->rows;
+    const elem *X = M + j*rows*h;
+    double ts = trace_now();
+    for(t=0; t<col->n_targets[p]; t++) {
+        int q = col->target[p][t];
+        elem *Z = col->quad[q] + j*rows*ldc;
+        if(!col->filled[q][j] && col->sign[p][t] > 0) {
+            for(i=0; i<rows; i++) {
+                memcpy(&Z[i*ldc], &X[i*h], h*sizeof(elem));
+            }
+        } else if(col->sign[p][t] > 0 && col->morton) {
+            msum_morton(col->quad[q], M, col->quad[0], q, h, j*rows, rows);
+        } else if(col->sign[p][t] > 0) {
+            for(i=0; i<rows; i++) {
+                row_sum(&Z[i*ldc], &X[i*h], &Z[i*ldc], h);
+            }
+        } else {
+            for(i=0; i<rows; i++) {
+                int k;
+                for(k=0; k<h; k++) {
+                    Z[i*ldc + k] -= X[i*h + k];
+                }
+            }
+        }
+        col->filled[q][j] = 1;
+        col->left[q][j]--;
+    }
+    trace_span(TRACE_MSUM, ts, col->source[p], (long)rows*h*sizeof(elem));
+}
+
+//Reduces panel j of product p once it has arrived. A quadrant still waiting
+//for that panel of its product received in place can't be reduced into yet.
+//Returns the number of other receives this had to complete.
+static int panel_arrived(collector *col, int p, int j, const elem *M) {
+    int t;
+    int waited = 0;
+    MPI_Status st;
+    double ts;
+    if(col->in_place[p]) {
+        landed(col, col->target[p][0], j);
+    } else {
+        for(t=0; t<col->n_targets[p]; t++) {
+            int q = col->target[p][t];
+            if(col->pending[q][j]) {
+                ts = trace_now();
+                MPI_Wait(&col->request[(col->pending[q][j]-1)*col->panels + j], &st);
+                trace_span(TRACE_WAIT, ts, st.MPI_SOURCE, 0);
+                landed(col, q, j);
+                waited++;
+            }
+        }
+        reduce_panel(col, p, j, M);
+    }
+    forward_ready(col);
+    return waited;
+}
+
+//Waits for every product and reduces it into C, then gives the buffers
+//back to the arena. When forwarding, returns once all of C has been sent.
+void collect_finish(collector *col) {
+    int p, i, j;
+    int h = col->h;
+    int panels = col->panels;
+    int remaining;
+    MPI_Status st;
+    double ts;
+    col->fwd_type = MPI_DATATYPE_NULL;
+    //Quadrants this process filled itself may already complete panels.
+    forward_ready(col);
+    if(!col->nonblocking) {
+        //Products come in the order they were declared, so those received
+        //in place always come first in their quadrant.
+        col->mark = ws_mark();
+        col->buffer[0] = NULL;
+        for(p=0; p<col->n; p++) {
+            if(!col->in_place[p] && col->buffer[0] == NULL) {
+                col->buffer[0] = ws_alloc((size_t)h*h);
+            }
+            for(j=0; j<panels; j++) {
+                post_panel(col, p, j, col->buffer[0], &col->request[p*panels + j]);
+            }
+            for(i=0; i<panels; i++) {
+                ts = trace_now();
+                MPI_Waitany(panels, &col->request[p*panels], &j, &st);
+                trace_span(TRACE_WAIT, ts, st.MPI_SOURCE, (long)col->rows*h*sizeof(elem));
+                panel_arrived(col, p, j, col->buffer[0]);
+            }
+        }
+    } else {
+        remaining = col->n*panels;
+        while(remaining > 0) {
+            ts = trace_now();
+            MPI_Waitany(col->n*panels, col->request, &i, &st);
+            trace_span(TRACE_WAIT, ts, st.MPI_SOURCE, (long)col->rows*h*sizeof(elem));
+            remaining--;
+            p = i/panels;
+            remaining -= panel_arrived(col, p, i%panels, col->buffer[p]);
+        }
+    }
+    if(col->dest >= 0) {
+        ts = trace_now();
+        MPI_Waitall(result_panels(2*h), col->fwd_request, MPI_STATUSES_IGNORE);
+        trace_span(TRACE_WAIT, ts, col->dest, 0);
+        if(col->fwd_type != MPI_DATATYPE_NULL) {
+            MPI_Type_free(&col->fwd_type);
+        }
+    }
+    MPI_Type_free(&col->panel_type);
+    ws_release(col->mark);
+}
+
+
+//====================================================================
+//Reduction between siblings
+
+//Workspace taken by pair_reduce() for an n x n result.
+size_t pair_workspace(int n) {
+    return ws_round((size_t)n*n);
+}
+
+//Adds the n x n result of process sibling, sent by send_result() or
+//streamed by a collector, to C, whose lines are n elements apart as well,
+//and streams every panel of the sum to process dest as soon as it is added.
+//Both results must have the same layout, row-major or Morton.
+void pair_reduce(elem *C, int n, int sibling, int dest) {
+    int panels = result_panels(n);
+    size_t size = (size_t)n*n/panels;
+    MPI_Request recv[RESULT_PANELS], send[RESULT_PANELS];
+    MPI_Status st;
+    size_t mark = ws_mark();
+    elem *M = ws_alloc((size_t)n*n);
+    int i, j;
+    double ts;
+    for(j=0; j<panels; j++) {
+        MPI_Irecv(M + j*size, size, MPI_ELEM, sibling, RESULT_TAG + j,
+                  MPI_COMM_WORLD, &recv[j]);
+    }
+    for(i=0; i<panels; i++) {
+        ts = trace_now();
+        MPI_Waitany(panels, recv, &j, &st);
+        trace_span(TRACE_WAIT, ts, sibling, (long)size*sizeof(elem));
+        ts = trace_now();
+        row_sum(C + j*size, M + j*size, C + j*size, size);
+        trace_span(TRACE_MSUM, ts, sibling, (long)size*sizeof(elem));
+        MPI_Isend(C + j*size, size, MPI_ELEM, dest, RESULT_TAG + j,
+                  MPI_COMM_WORLD, &send[j]);
+    }
+    ts = trace_now();
+    MPI_Waitall(panels, send, MPI_STATUSES_IGNORE);
+    trace_span(TRACE_WAIT, ts, dest, 0);
+    ws_release(mark);
+}
+
+//====================================================================
+//One-sided assembly of the result
+
+//Result of the root, for a run on a single process: there is no window
+//then, some MPI libraries not creating any for a lone process.
+static elem *local_result = NULL;
+
+//Exposes the n x n result of the root, zeroed and returned in *R, as an RMA
+//window, and opens an epoch to it on every process. *R is NULL elsewhere.
+//Collective over MPI_COMM_WORLD.
+void result_window_open(elem **R, int n, MPI_Win *win) {
+    int my_rank, proc_n;
+    MPI_Aint size = 0;
+    MPI_Info info;
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &proc_n);
+    *R = NULL;
+    if(my_rank == 0) {
+        matrix_alloc(R, n);
+        memset(*R, 0, (size_t)n*n*sizeof(elem));
+        size = (MPI_Aint)n*n*sizeof(elem);
+    }
+    if(proc_n == 1) {
+        local_result = *R;
+        *win = MPI_WIN_NULL;
+        return;
+    }
+    //Only sums ever reach the window.
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "accumulate_ops", "same_op");
+    MPI_Win_create(*R, size, sizeof(elem), info, MPI_COMM_WORLD, win);
+    MPI_Info_free(&info);
+    MPI_Win_lock_all(0, *win);
+}
+
+//Adds the n x n block X, whose lines are ldx elements apart, to the result
+//of the root at element disp, where its lines are ldr elements apart.
+void result_accumulate(const elem *X, int ldx, int n, MPI_Aint disp, int ldr,
+                       MPI_Win win) {
+    MPI_Datatype origin = MPI_DATATYPE_NULL;
+    MPI_Datatype target = MPI_DATATYPE_NULL;
+    int i;
+    double ts = trace_now();
+    if(win == MPI_WIN_NULL) {
+        for(i=0; i<n; i++) {
+            row_sum(&local_result[disp + (MPI_Aint)i*ldr], &X[(size_t)i*ldx],
+                    &local_result[disp + (MPI_Aint)i*ldr], n);
+        }
+        trace_span(TRACE_MSUM, ts, -1, (long)n*n*sizeof(elem));
+        return;
+    }
+    if(ldx != n) {
+        origin = block_type(n, ldx);
+    }
+    if(ldr != n) {
+        target = block_type(n, ldr);
+    }
+    MPI_Accumulate((void *)X, (ldx == n) ? n*n : 1, (ldx == n) ? MPI_ELEM : origin,
+                   0, disp, (ldr == n) ? n*n : 1, (ldr == n) ? MPI_ELEM : target,
+                   MPI_SUM, win);
+    MPI_Win_flush(0, win);
+    if(origin != MPI_DATATYPE_NULL) {
+        MPI_Type_free(&origin);
+    }
+    if(target != MPI_DATATYPE_NULL) {
+        MPI_Type_free(&target);
+    }
+    trace_span(TRACE_SEND, ts, 0, (long)n*n*sizeof(elem));
+}
+
+//Closes the epoch and the window. Since MPI_Win_free() waits for every
+//process, the result of the root is complete once it returns.
+//Collective over MPI_COMM_WORLD.
+void result_window_close(MPI_Win *win) {
+    double ts;
+    if(*win == MPI_WIN_NULL) {
+        return;
+    }
+    ts = trace_now();
+    MPI_Win_unlock_all(*win);
+    MPI_Win_free(win);
+    trace_span(TRACE_WAIT, ts, -1, 0);
+}
@@ -0,0 +1,326 @@
+/*
+Runtime configuration shared by the drivers, so experiments don't need a
+rebuild. Every setting can be given on the command line or through the
+environment, the command line winning:
+    -n N        MMULTI_DIM=N            N x N matrices
+    -s MxKxN    MMULTI_SHAPE=MxKxN      M x K times K x N matrices
+    -d D        MMULTI_DIVISIONS=D      divisions before conquering
+    -c C        MMULTI_CUTOFF=C         leaf cutoff of mmulti()
+    -k NAME     MMULTI_KERNEL=NAME      leaf micro-kernel (see kernel_name())
+    -a FILE     MMULTI_A=FILE           read A from a matrix file (see matfile.c)
+    -b FILE     MMULTI_B=FILE           read B from a matrix file
+    -o FILE     MMULTI_C=FILE           write C to a matrix file
+    -t FILE     MMULTI_TRACE=FILE       record a timeline (see trace.c)
+    -q DIR      MMULTI_SPOOL=DIR        spool directory of serve_mmulti
+Dimensions need not be powers of two. Drivers that only split square
+matrices in halves pad them with zeros up to the next dimension they can
+split (see config_padded()), and only the M x N corner of their C is
+meaningful.
+
+Before any of them, the tuning profile of the node is loaded, when there is
+one (see config_load_profile()).
+
+Example use:
+    ladrun -np 73 strat_c_mmulti -s 5000x3000x4000 -d 2
+
+At the end of a run, the drivers print its settings and outcome on a single
+RESULT line (see config_report()) for benchsweep to collect.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "mmulti.h"
+
+//Shape of the multiplication: A is cfg_m x cfg_k, B is cfg_k x cfg_n.
+int cfg_m;
+int cfg_k;
+int cfg_n;
+
+//Divisions performed before conquering, for the tree drivers.
+int cfg_divisions;
+
+//Matrix files of the operands and of the result, or NULL. Drivers reading
+//their operands from files take the shape from them.
+char *cfg_a_file;
+char *cfg_b_file;
+char *cfg_c_file;
+
+//File the timeline of the run is written to, or NULL.
+char *cfg_trace_file;
+
+//Directory serve_mmulti takes its jobs from, or NULL.
+char *cfg_spool_dir;
+
+
+//Reads a positive integer. Returns -1 if s is not one.
+static int parse_positive(const char *s) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    if(end == s || *end != '\0' || v <= 0 || v > (1<<30)) {
+        return -1;
+    }
+    return (int)v;
+}
+
+//Reads MxKxN, or a single N for square matrices.
+static int parse_shape(const char *s) {
+    int m, k, n;
+    char tail;
+    if(sscanf(s, "%dx%dx%d%c", &m, &k, &n, &tail) == 3) {
+        if(m <= 0 || k <= 0 || n <= 0) {
+            return -1;
+        }
+        cfg_m = m;
+        cfg_k = k;
+        cfg_n = n;
+        return 0;
+    }
+    n = parse_positive(s);
+    if(n < 0) {
+        return -1;
+    }
+    cfg_m = cfg_k = cfg_n = n;
+    return 0;
+}
+
+//Selects the micro-kernel called name.
+static int select_kernel(const char *name) {
+    int k;
+    for(k=0; k<KERNEL_COUNT; k++) {
+        if(strcmp(name, kernel_name(k)) == 0) {
+            return kernel_select(k);
+        }
+    }
+    return -1;
+}
+
+//Applies setting opt (one of the letters above) with value val.
+static int apply(int opt, const char *val, int quiet) {
+    int v;
+    switch(opt) {
+    case 'n':
+    case 's':
+        if(parse_shape(val) == 0) {
+            return 0;
+        }
+        break;
+    case 'd':
+        v = (strcmp(val, "0") == 0) ? 0 : parse_positive(val);
+        if(v >= 0 && v < 16) {
+            cfg_divisions = v;
+            return 0;
+        }
+        break;
+    case 'c':
+        v = parse_positive(val);
+        if(v > 0) {
+            mmulti_cutoff = v;
+            return 0;
+        }
+        break;
+    case 'k':
+        if(select_kernel(val) == 0) {
+            return 0;
+        }
+        break;
+    case 'a':
+        cfg_a_file = (char *)val;
+        return 0;
+    case 'b':
+        cfg_b_file = (char *)val;
+        return 0;
+    case 'o':
+        cfg_c_file = (char *)val;
+        return 0;
+    case 't':
+        cfg_trace_file = (char *)val;
+        return 0;
+    case 'q':
+        cfg_spool_dir = (char *)val;
+        return 0;
+    }
+    if(!quiet) {
+        printf("Invalid value for -%c: %s\n", opt, val);
+    }
+    return -1;
+}
+
+/*
+Params:
+argc, argv = command line of the driver.
+dim = default dimension of the square matrices.
+divisions = default number of divisions.
+quiet = set on every process but one so errors are only reported once.
+Returns 0, or -1 if a setting is invalid.
+*/
+int config_init(int argc, char **argv, int dim, int divisions, int quiet) {
+    static const char *env[] = {"MMULTI_DIM", "MMULTI_SHAPE", "MMULTI_DIVISIONS",
+                                "MMULTI_CUTOFF", "MMULTI_KERNEL",
+                                "MMULTI_A", "MMULTI_B", "MMULTI_C",
+                                "MMULTI_TRACE", "MMULTI_SPOOL"};
+    static const char opts[] = "nsdckabotq";
+    char *val;
+    int i, opt;
+
+    cfg_m = cfg_k = cfg_n = dim;
+    cfg_divisions = divisions;
+    cfg_a_file = cfg_b_file = cfg_c_file = NULL;
+    cfg_trace_file = NULL;
+    cfg_spool_dir = NULL;
+
+    if(config_load_profile(quiet) != 0) {
+        return -1;
+    }
+
+    for(i=0; i<10; i++) {
+        val = getenv(env[i]);
+        if(val != NULL && apply(opts[i], val, quiet) != 0) {
+            return -1;
+        }
+    }
+
+    opterr = !quiet;
+    while((opt = getopt(argc, argv, "n:s:d:c:k:a:b:o:t:q:")) != -1) {
+        if(opt == '?' || apply(opt, optarg, quiet) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//====================================================================
+//Tuning profile
+
+//Path of the tuning profile: MMULTI_PROFILE, or DEFAULT_PROFILE in the
+//working directory.
+char *config_profile_path() {
+    char *path = getenv("MMULTI_PROFILE");
+    return (path != NULL) ? path : DEFAULT_PROFILE;
+}
+
+/*
+Loads the tuning profile written by tune_mmulti, if there is one: lines of
+"key value" setting the leaf kernel, the cutoffs of mmulti() and of the
+Strassen recursion, the cache blocking of the leaf kernel and the number of
+divisions of the tree drivers. Keys left out keep their built-in default,
+lines starting with # are comments. The environment and the command line
+still override everything. A kernel the node doesn't support is reported
+and left to the runtime pick.
+quiet = set on every process but one so errors are only reported once.
+Returns 0, or -1 if the profile is invalid.
+*/
+int config_load_profile(int quiet) {
+    char *path = config_profile_path();
+    char line[256], key[64], val[128];
+    int v, lineno = 0;
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+        return 0;
+    }
+    while(fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        if(line[0] == '#' || sscanf(line, "%63s %127s", key, val) < 1) {
+            continue;
+        }
+        v = (strcmp(val, "0") == 0) ? 0 : parse_positive(val);
+        if(strcmp(key, "kernel") == 0) {
+            //Profiles are often shared by nodes of different CPUs: one
+            //lacking the tuned kernel keeps its own pick (see kernel_init()).
+            if(select_kernel(val) != 0 && !quiet) {
+                printf("%s:%d: kernel %s not supported here, using %s.\n",
+                       path, lineno, val, kernel_name(kernel_current()));
+            }
+            continue;
+        }
+        if(v > 0) {
+            if(strcmp(key, "cutoff") == 0) {
+                mmulti_cutoff = v;
+                continue;
+            } else if(strcmp(key, "strassen_cutoff") == 0) {
+                strassen_cutoff = v;
+                continue;
+            } else if(strcmp(key, "mc") == 0) {
+                tile_mc = v;
+                continue;
+            } else if(strcmp(key, "kc") == 0) {
+                tile_kc = v;
+                continue;
+            } else if(strcmp(key, "nc") == 0) {
+                tile_nc = v;
+                continue;
+            }
+        }
+        if(strcmp(key, "divisions") == 0 && v >= 0 && v < 16) {
+            cfg_divisions = v;
+            continue;
+        }
+        if(!quiet) {
+            printf("%s:%d: invalid setting: %s", path, lineno, line);
+        }
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+//Writes the current settings as the tuning profile, with divisions as the
+//number of divisions, or none if it is negative. Returns 0, or -1 if the
+//file can't be written.
+int config_save_profile(int divisions) {
+    char *path = config_profile_path();
+    FILE *f = fopen(path, "w");
+    if(f == NULL) {
+        printf("Can't write the tuning profile to %s.\n", path);
+        return -1;
+    }
+    fprintf(f, "# Written by tune_mmulti for %s matrices.\n", ELEM_NAME);
+    fprintf(f, "kernel %s\n", kernel_name(kernel_current()));
+    fprintf(f, "mc %d\nkc %d\nnc %d\n", tile_mc, tile_kc, tile_nc);
+    fprintf(f, "cutoff %d\n", mmulti_cutoff);
+    fprintf(f, "strassen_cutoff %d\n", strassen_cutoff);
+    if(divisions >= 0) {
+        fprintf(f, "divisions %d\n", divisions);
+    }
+    fclose(f);
+    return 0;
+}
+
+//Largest dimension of the shape rounded up to a multiple of m, the side
+//of the square matrices a driver splitting in m works on.
+int config_padded(int m) {
+    int d = cfg_m;
+    if(cfg_k > d) {
+        d = cfg_k;
+    }
+    if(cfg_n > d) {
+        d = cfg_n;
+    }
+    return (d + m-1)/m*m;
+}
+
+/*
+Params:
+driver = name of the driver.
+seconds = time the multiplication took, as measured on the root.
+Collective over MPI_COMM_WORLD. The root prints, as CSV fields:
+RESULT,driver,elem,m,k,n,procs,divisions,cutoff,kernel,seconds,gops,peak_kib
+gops counting the 2*M*N*K operations of the unpadded shape, and peak_kib
+being the memory high-water mark of the process that used the most.
+*/
+void config_report(const char *driver, double seconds) {
+    long peak = mem_peak_kib();
+    long peak_max;
+    int my_rank, proc_n;
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &proc_n);
+    MPI_Reduce(&peak, &peak_max, 1, MPI_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+    if(my_rank == 0) {
+        printf("RESULT,%s,%s,%d,%d,%d,%d,%d,%d,%s,%.6f,%.3f,%ld\n",
+               driver, ELEM_NAME, cfg_m, cfg_k, cfg_n, proc_n, cfg_divisions,
+               mmulti_cutoff, kernel_name(kernel_current()), seconds,
+               2.0*cfg_m*cfg_n*(double)cfg_k/seconds*1e-9, peak_max);
+    }
+}
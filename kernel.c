@@ -0,0 +1,257 @@
+/*
+Packed, cache-blocked leaf kernel used once the divide and conquer recursion
+reaches the conquering point.
+
+The loop nest follows the usual three level blocking:
+    - B is split in KC x NC panels which are packed once and stay in L3.
+    - A is split in MC x KC blocks which are packed once and stay in L2.
+    - The packed panels are swept by a MR x NR micro-kernel which keeps its
+      whole tile of C in registers while streaming through KC.
+Packing also zero pads partial panels so the micro-kernel never has to check
+for edges while accumulating.
+
+The micro-kernel and the row sum used by msum() are picked once at startup
+among the scalar fallback and the SIMD variants in simd_kernels.c, according
+to what cpuid reports for the current node.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mmulti.h"
+
+//Blocking sizes, in elements. Kept as variables so they can be tuned
+//without rebuilding.
+int tile_mc = MC_DEFAULT;
+int tile_kc = KC_DEFAULT;
+int tile_nc = NC_DEFAULT;
+
+
+//Packs the mc x kc block of A starting at A into panels of MR rows.
+//Inside a panel elements are stored colum by colum so the micro-kernel reads
+//MR consecutive values for each step of k.
+static void pack_a(const elem *A, int lda, int mc, int kc, elem *Ap) {
+    int i, p, r;
+    for(i=0; i<mc; i+=MR) {
+        int mr = (mc-i < MR) ? mc-i : MR;
+        for(p=0; p<kc; p++) {
+            for(r=0; r<mr; r++) {
+                Ap[r] = A[(i+r)*lda + p];
+            }
+            for(; r<MR; r++) {
+                Ap[r] = 0;
+            }
+            Ap += MR;
+        }
+    }
+}
+
+//Packs the kc x nc panel of B starting at B into panels of NR colums.
+//Inside a panel elements are stored row by row so the micro-kernel reads
+//NR consecutive values for each step of k.
+static void pack_b(const elem *B, int ldb, int kc, int nc, elem *Bp) {
+    int j, p, c;
+    for(j=0; j<nc; j+=NR) {
+        int nr = (nc-j < NR) ? nc-j : NR;
+        for(p=0; p<kc; p++) {
+            const elem *b = &B[p*ldb + j];
+            for(c=0; c<nr; c++) {
+                Bp[c] = b[c];
+            }
+            for(; c<NR; c++) {
+                Bp[c] = 0;
+            }
+            Bp += NR;
+        }
+    }
+}
+
+//MR x NR register tile: C[0..mr)[0..nr) += Ap * Bp.
+//Ap and Bp point to packed panels of depth kc.
+void micro_kernel_scalar(int kc, const elem *Ap, const elem *Bp,
+                         elem *C, int ldc, int mr, int nr) {
+    elem acc[MR][NR];
+    int p, r, c;
+    memset(acc, 0, sizeof(acc));
+    for(p=0; p<kc; p++) {
+        for(r=0; r<MR; r++) {
+            elem a = Ap[r];
+            for(c=0; c<NR; c++) {
+                acc[r][c] += a*Bp[c];
+            }
+        }
+        Ap += MR;
+        Bp += NR;
+    }
+    for(r=0; r<mr; r++) {
+        for(c=0; c<nr; c++) {
+            C[r*ldc + c] += acc[r][c];
+        }
+    }
+}
+
+void row_sum_scalar(const elem *a, const elem *b, elem *c, int n) {
+    int j;
+    for(j=0; j<n; j++) {
+        c[j] = a[j] + b[j];
+    }
+}
+
+
+//====================================================================
+//Runtime kernel dispatch
+
+typedef struct {
+    char *name;
+    micro_kernel_fn micro;
+    row_sum_fn sum;
+} kernel_variant;
+
+static kernel_variant variants[KERNEL_COUNT] = {
+    {"scalar", micro_kernel_scalar, row_sum_scalar},
+#if defined(__x86_64__) || defined(__i386__)
+    {"sse4.1", micro_kernel_sse41,  row_sum_sse41},
+    {"avx2",   micro_kernel_avx2,   row_sum_avx2},
+    {"avx512", micro_kernel_avx512, row_sum_avx512},
+#endif
+};
+
+static int current_kernel = -1;
+static micro_kernel_fn micro_kernel;
+static row_sum_fn row_sum_kernel;
+
+//Tells whether the node we are running on can execute the given variant.
+//__builtin_cpu_supports() reads cpuid and also checks the OS saves the
+//wider registers.
+int kernel_supported(int kernel) {
+    switch(kernel) {
+    case KERNEL_SCALAR:
+        return 1;
+#if defined(__x86_64__) || defined(__i386__)
+    case KERNEL_SSE41:
+        return __builtin_cpu_supports("sse4.1");
+    case KERNEL_AVX2:
+#if ELEM_TYPE == ELEM_FLOAT || ELEM_TYPE == ELEM_DOUBLE
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+        return __builtin_cpu_supports("avx2");
+#endif
+    case KERNEL_AVX512:
+        return __builtin_cpu_supports("avx512f");
+#endif
+    }
+    return 0;
+}
+
+//Forces the use of one kernel variant. Returns -1 if the node can't run it.
+int kernel_select(int kernel) {
+    if(kernel<0 || kernel>=KERNEL_COUNT || !kernel_supported(kernel)) {
+        return -1;
+    }
+    micro_kernel = variants[kernel].micro;
+    row_sum_kernel = variants[kernel].sum;
+    current_kernel = kernel;
+    return 0;
+}
+
+//Picks the widest variant supported by the current node.
+void kernel_init() {
+    int k;
+    for(k=KERNEL_COUNT-1; k>=0; k--) {
+        if(kernel_select(k)==0) {
+            return;
+        }
+    }
+}
+
+char *kernel_name(int kernel) {
+    if(kernel<0 || kernel>=KERNEL_COUNT) {
+        return "unknown";
+    }
+    return variants[kernel].name;
+}
+
+int kernel_current() {
+    if(current_kernel<0) {
+        kernel_init();
+    }
+    return current_kernel;
+}
+
+//c[0..n) = a[0..n) + b[0..n)
+void row_sum(const elem *a, const elem *b, elem *c, int n) {
+    if(current_kernel<0) {
+        kernel_init();
+    }
+    row_sum_kernel(a, b, c, n);
+}
+
+
+/*
+Params:
+A = pointer to the top left element of the m x k operand.
+lda = distance between two consecutive lines of A.
+B = pointer to the top left element of the k x n operand.
+ldb = distance between two consecutive lines of B.
+C = pointer to the top left element of the m x n result.
+ldc = distance between two consecutive lines of C.
+Computes C += A*B, so partial products of a block of C can be accumulated
+in place.
+*/
+void tiled_multi_acc(const elem *A, int lda, const elem *B, int ldb,
+                     elem *C, int ldc, int m, int n, int k) {
+    int jc, pc, ic, jr, ir;
+    elem *Ap;
+    elem *Bp;
+    int mc_max = (tile_mc < m) ? tile_mc : m;
+    int kc_max = (tile_kc < k) ? tile_kc : k;
+    int nc_max = (tile_nc < n) ? tile_nc : n;
+    size_t mark;
+
+    if(current_kernel<0) {
+        kernel_init();
+    }
+    if(m==0 || n==0 || k==0) {
+        return;
+    }
+
+    //Packed buffers are rounded up to whole micro-panels.
+    if(ws_idle()) {
+        ws_reserve(tiled_workspace(m, n, k));
+    }
+    mark = ws_mark();
+    Ap = ws_alloc((size_t)(mc_max+MR-1)/MR*MR*kc_max);
+    Bp = ws_alloc((size_t)(nc_max+NR-1)/NR*NR*kc_max);
+
+    for(jc=0; jc<n; jc+=tile_nc) {
+        int nc = (n-jc < tile_nc) ? n-jc : tile_nc;
+        for(pc=0; pc<k; pc+=tile_kc) {
+            int kc = (k-pc < tile_kc) ? k-pc : tile_kc;
+            pack_b(&B[pc*ldb + jc], ldb, kc, nc, Bp);
+            for(ic=0; ic<m; ic+=tile_mc) {
+                int mc = (m-ic < tile_mc) ? m-ic : tile_mc;
+                pack_a(&A[ic*lda + pc], lda, mc, kc, Ap);
+                for(jr=0; jr<nc; jr+=NR) {
+                    int nr = (nc-jr < NR) ? nc-jr : NR;
+                    for(ir=0; ir<mc; ir+=MR) {
+                        int mr = (mc-ir < MR) ? mc-ir : MR;
+                        micro_kernel(kc, &Ap[ir*kc], &Bp[jr*kc],
+                                     &C[(ic+ir)*ldc + jc+jr], ldc, mr, nr);
+                    }
+                }
+            }
+        }
+    }
+
+    ws_release(mark);
+}
+
+//Computes C = A*B.
+void tiled_multi(const elem *A, int lda, const elem *B, int ldb,
+                 elem *C, int ldc, int m, int n, int k) {
+    int i;
+    for(i=0; i<m; i++) {
+        memset(&C[i*ldc], 0, n*sizeof(elem));
+    }
+    tiled_multi_acc(A, lda, B, ldb, C, ldc, m, n, k);
+}
@@ -0,0 +1,406 @@
+/*
+Binary matrix files, for matrices too big for the memory of the processes
+working on them.
+
+A file starts with a header of MFILE_HEADER bytes giving the magic "MMAT",
+the element type (ELEM_TYPE of the build that wrote it), the dimensions and
+the tile size T. The matrix follows as T x T tiles, tile lines one after the
+other, each tile stored line by line. Tiles on the right and bottom edges are
+padded with zeros, so every tile is a contiguous T x T matrix the kernels can
+work on in place.
+
+Files are used through mmap: a tile is just a pointer into the mapping, the
+kernel pages it in when the multiplication touches it and can evict it again
+once it was released with mfile_release(). At no point does a process need
+the whole matrix in memory.
+
+The second part of the file gives the same access through MPI-IO, for
+drivers where each process owns a block of the matrices.
+
+Example use:
+    matgen a.mat 50000 30000 0
+    matgen b.mat 30000 40000 2
+    ladrun -np 64 pool_mmulti -a a.mat -b b.mat -o c.mat
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mmulti.h"
+
+#define MFILE_VERSION 1
+
+typedef struct {
+    char magic[4];
+    int version;
+    int elem_type;
+    int elem_size;
+    int rows;
+    int cols;
+    int tile;
+} mfile_header;
+
+
+//Size of the file holding a rows x cols matrix in tiles of tile x tile.
+static size_t file_size(int rows, int cols, int tile) {
+    size_t tl = (rows + tile-1)/tile;
+    size_t tc = (cols + tile-1)/tile;
+    return MFILE_HEADER + tl*tc*tile*tile*sizeof(elem);
+}
+
+static int map_file(matrix_file *f, const char *path, int writable) {
+    f->size = file_size(f->rows, f->cols, f->tile);
+    f->writable = writable;
+    f->tiles_per_line = (f->cols + f->tile-1)/f->tile;
+    f->map = mmap(NULL, f->size, writable ? PROT_READ|PROT_WRITE : PROT_READ,
+                  MAP_SHARED, f->fd, 0);
+    if(f->map == MAP_FAILED) {
+        printf("Can't map %s.\n", path);
+        close(f->fd);
+        return -1;
+    }
+    f->data = (elem *)(f->map + MFILE_HEADER);
+    return 0;
+}
+
+/*
+Params:
+f = file to fill in.
+path = file created, or truncated if it exists.
+rows, cols = dimensions of the matrix.
+tile = lines/colums of the tiles.
+Creates a file for a rows x cols matrix of zeros, mapped for writing.
+Returns 0, or -1 if it can't be created.
+*/
+int mfile_create(matrix_file *f, const char *path, int rows, int cols, int tile) {
+    mfile_header h;
+    memset(f, 0, sizeof(matrix_file));
+    f->rows = rows;
+    f->cols = cols;
+    f->tile = tile;
+    f->fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if(f->fd < 0) {
+        printf("Can't create %s.\n", path);
+        return -1;
+    }
+    if(ftruncate(f->fd, file_size(rows, cols, tile)) != 0) {
+        printf("Can't grow %s.\n", path);
+        close(f->fd);
+        return -1;
+    }
+    if(map_file(f, path, 1) != 0) {
+        return -1;
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "MMAT", 4);
+    h.version = MFILE_VERSION;
+    h.elem_type = ELEM_TYPE;
+    h.elem_size = sizeof(elem);
+    h.rows = rows;
+    h.cols = cols;
+    h.tile = tile;
+    memcpy(f->map, &h, sizeof(h));
+    return 0;
+}
+
+//Opens the matrix in path, for writing if writable is set. Returns 0, or -1
+//if it can't be opened or wasn't written by a build with the same element
+//type.
+int mfile_open(matrix_file *f, const char *path, int writable) {
+    mfile_header h;
+    memset(f, 0, sizeof(matrix_file));
+    f->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if(f->fd < 0) {
+        printf("Can't open %s.\n", path);
+        return -1;
+    }
+    if(pread(f->fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, "MMAT", 4) != 0
+       || h.version != MFILE_VERSION || h.rows <= 0 || h.cols <= 0 || h.tile <= 0) {
+        printf("%s is not a matrix file.\n", path);
+        close(f->fd);
+        return -1;
+    }
+    if(h.elem_type != ELEM_TYPE || h.elem_size != sizeof(elem)) {
+        printf("%s doesn't hold %s elements.\n", path, ELEM_NAME);
+        close(f->fd);
+        return -1;
+    }
+    f->rows = h.rows;
+    f->cols = h.cols;
+    f->tile = h.tile;
+    return map_file(f, path, writable);
+}
+
+void mfile_close(matrix_file *f) {
+    munmap(f->map, f->size);
+    close(f->fd);
+}
+
+//Elements before tile (ti, tj) in the data of the file.
+static size_t tile_offset(matrix_file *f, int ti, int tj) {
+    return ((size_t)ti*f->tiles_per_line + tj)*f->tile*f->tile;
+}
+
+//Top left element of tile (ti, tj). Lines of a tile are f->tile elements
+//apart.
+elem *mfile_tile(matrix_file *f, int ti, int tj) {
+    return f->data + tile_offset(f, ti, tj);
+}
+
+//Done with tile (ti, tj) for now: changes to it start going to disk and its
+//pages leave the memory of the process. It is paged back in if touched again.
+void mfile_release(matrix_file *f, int ti, int tj) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *start = (char *)mfile_tile(f, ti, tj);
+    char *end = start + (size_t)f->tile*f->tile*sizeof(elem);
+    //Only whole pages of the tile can be dropped.
+    start = f->map + ((size_t)(start - f->map) + page-1)/page*page;
+    end = f->map + (size_t)(end - f->map)/page*page;
+    if(end <= start) {
+        return;
+    }
+    if(f->writable) {
+        msync(start, end-start, MS_ASYNC);
+    }
+    madvise(start, end-start, MADV_DONTNEED);
+}
+
+/*
+Params:
+A, B = files of the operands, with tiles of the same size.
+ti, tj = tile of C being computed.
+C = pointer to the top left element of the result.
+ldc = distance between two consecutive lines of C.
+rows, cols = lines/colums of the tile actually inside C.
+Computes tile (ti, tj) of C = A*B, streaming line ti of the tiles of A and
+colum tj of the tiles of B through the leaf kernel. The zero padding of the
+tiles on the edges keeps the inner dimension a whole number of tiles.
+*/
+void mfile_tile_product(matrix_file *A, matrix_file *B, int ti, int tj,
+                        elem *C, int ldc, int rows, int cols) {
+    int t = A->tile;
+    int tk;
+    int i;
+    for(i=0; i<rows; i++) {
+        memset(&C[i*ldc], 0, cols*sizeof(elem));
+    }
+    for(tk=0; tk<A->tiles_per_line; tk++) {
+        tiled_multi_acc(mfile_tile(A, ti, tk), t, mfile_tile(B, tk, tj), t,
+                        C, ldc, rows, cols, t);
+    }
+}
+
+//Workspace mfile_tile_product() needs, in elements.
+size_t mfile_workspace(matrix_file *A) {
+    return tiled_workspace(A->tile, A->tile, A->tile);
+}
+
+//Out-of-core C = A*B on a single process. C must have been created with the
+//same tiles as A and B. Every tile of C is written back as soon as it is
+//done, and every line of tiles of A once the line of C it gives is done.
+void ooc_multi(matrix_file *A, matrix_file *B, matrix_file *C) {
+    int ti, tj, tk;
+    int lines = (C->rows + C->tile-1)/C->tile;
+    ws_reserve(mfile_workspace(A));
+    for(ti=0; ti<lines; ti++) {
+        for(tj=0; tj<C->tiles_per_line; tj++) {
+            mfile_tile_product(A, B, ti, tj, mfile_tile(C, ti, tj), C->tile,
+                               C->tile, C->tile);
+            mfile_release(C, ti, tj);
+        }
+        for(tk=0; tk<A->tiles_per_line; tk++) {
+            mfile_release(A, ti, tk);
+        }
+    }
+}
+
+
+//====================================================================
+//Parallel access through MPI-IO, for drivers where every process owns a
+//block of the matrices. The file is opened by all the processes of a
+//communicator and each of them reads or writes its own block in one
+//collective call, so no process ever has to gather a whole matrix.
+
+/*
+Builds the datatypes describing the m x n block at line l, colum c of the
+matrix in f: file_type selects its elements in the file, mem_type the same
+elements in a buffer whose lines are ldx elements apart. Parts of the block
+past the edges of the matrix are left out. Elements are listed in the order
+they come in the file, as file views need. Returns the number of runs of
+consecutive elements, 0 if the block is entirely outside the matrix.
+*/
+static int block_types(matrix_file *f, int ldx, int l, int c, int m, int n,
+                       MPI_Datatype *file_type, MPI_Datatype *mem_type) {
+    int t = f->tile;
+    int ti, tj, i, j0, j1;
+    int count = 0;
+    int *len;
+    MPI_Aint *fdisp;
+    MPI_Aint *mdisp;
+
+    if(l + m > f->rows) {
+        m = f->rows - l;
+    }
+    if(c + n > f->cols) {
+        n = f->cols - c;
+    }
+    if(m <= 0 || n <= 0) {
+        return 0;
+    }
+
+    //At most one run per line of the block and tile it crosses.
+    i = m*((n + t-1)/t + 1);
+    len = malloc(i*sizeof(int));
+    fdisp = malloc(i*sizeof(MPI_Aint));
+    mdisp = malloc(i*sizeof(MPI_Aint));
+    if(len == NULL || fdisp == NULL || mdisp == NULL) {
+        printf("malloc failed!\n");
+        exit(1);
+    }
+    for(ti=l/t; ti*t < l+m; ti++) {
+        for(tj=c/t; tj*t < c+n; tj++) {
+            j0 = (c > tj*t) ? c : tj*t;
+            j1 = (c+n < (tj+1)*t) ? c+n : (tj+1)*t;
+            for(i=(l > ti*t) ? l : ti*t; i < l+m && i < (ti+1)*t; i++) {
+                len[count] = j1 - j0;
+                fdisp[count] = (((MPI_Aint)ti*f->tiles_per_line + tj)*t*t
+                                + (MPI_Aint)(i - ti*t)*t + (j0 - tj*t))*sizeof(elem);
+                mdisp[count] = ((MPI_Aint)(i - l)*ldx + (j0 - c))*sizeof(elem);
+                count++;
+            }
+        }
+    }
+    MPI_Type_create_hindexed(count, len, fdisp, MPI_ELEM, file_type);
+    MPI_Type_create_hindexed(count, len, mdisp, MPI_ELEM, mem_type);
+    MPI_Type_commit(file_type);
+    MPI_Type_commit(mem_type);
+    free(len);
+    free(fdisp);
+    free(mdisp);
+    return count;
+}
+
+//Opens the matrix in path on every process of comm, for MPI-IO, read only
+//unless writable is set. Collective. Returns 0, or -1 if it can't be opened
+//or wasn't written by a build with the same element type.
+int mfile_popen(matrix_file *f, const char *path, int writable, MPI_Comm comm) {
+    mfile_header h;
+    memset(f, 0, sizeof(matrix_file));
+    f->writable = writable;
+    if(MPI_File_open(comm, (char *)path, writable ? MPI_MODE_RDWR : MPI_MODE_RDONLY,
+                     MPI_INFO_NULL, &f->fh) != MPI_SUCCESS) {
+        printf("Can't open %s.\n", path);
+        return -1;
+    }
+    MPI_File_read_at_all(f->fh, 0, &h, sizeof(h), MPI_BYTE, MPI_STATUS_IGNORE);
+    if(memcmp(h.magic, "MMAT", 4) != 0 || h.version != MFILE_VERSION
+       || h.rows <= 0 || h.cols <= 0 || h.tile <= 0) {
+        printf("%s is not a matrix file.\n", path);
+        MPI_File_close(&f->fh);
+        return -1;
+    }
+    if(h.elem_type != ELEM_TYPE || h.elem_size != sizeof(elem)) {
+        printf("%s doesn't hold %s elements.\n", path, ELEM_NAME);
+        MPI_File_close(&f->fh);
+        return -1;
+    }
+    f->rows = h.rows;
+    f->cols = h.cols;
+    f->tile = h.tile;
+    f->tiles_per_line = (f->cols + f->tile-1)/f->tile;
+    return 0;
+}
+
+//Creates the file of a rows x cols matrix of zeros on every process of comm,
+//for MPI-IO. Collective. Returns 0, or -1 if it can't be created.
+int mfile_pcreate(matrix_file *f, const char *path, int rows, int cols, int tile,
+                  MPI_Comm comm) {
+    mfile_header h;
+    int rank;
+    memset(f, 0, sizeof(matrix_file));
+    f->rows = rows;
+    f->cols = cols;
+    f->tile = tile;
+    f->tiles_per_line = (cols + tile-1)/tile;
+    f->writable = 1;
+    if(MPI_File_open(comm, (char *)path, MPI_MODE_RDWR|MPI_MODE_CREATE, MPI_INFO_NULL,
+                     &f->fh) != MPI_SUCCESS) {
+        printf("Can't create %s.\n", path);
+        return -1;
+    }
+    //An older file of the same name is emptied first, so its bytes never
+    //show through the padding of the edge tiles.
+    MPI_File_set_size(f->fh, 0);
+    MPI_File_set_size(f->fh, file_size(rows, cols, tile));
+    MPI_Comm_rank(comm, &rank);
+    if(rank == 0) {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "MMAT", 4);
+        h.version = MFILE_VERSION;
+        h.elem_type = ELEM_TYPE;
+        h.elem_size = sizeof(elem);
+        h.rows = rows;
+        h.cols = cols;
+        h.tile = tile;
+        MPI_File_write_at(f->fh, 0, &h, sizeof(h), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+    return 0;
+}
+
+void mfile_pclose(matrix_file *f) {
+    MPI_File_close(&f->fh);
+}
+
+/*
+Params:
+f = file opened with mfile_popen() or mfile_pcreate().
+X = pointer to the top left element of the block in memory.
+ldx = distance between two consecutive lines of X.
+l, c = line and colum of the top left element of the block in the matrix.
+m, n = lines/colums of the block.
+Reads the block of every process in one collective call. Elements of the
+block past the edges of the matrix are zeros, which pads it. Processes
+with nothing to read still take part, with m or n = 0.
+*/
+void mfile_read_all(matrix_file *f, elem *X, int ldx, int l, int c, int m, int n) {
+    MPI_Datatype file_type, mem_type;
+    int i;
+    for(i=0; i<m; i++) {
+        memset(&X[(size_t)i*ldx], 0, n*sizeof(elem));
+    }
+    if(block_types(f, ldx, l, c, m, n, &file_type, &mem_type) == 0) {
+        MPI_File_set_view(f->fh, MFILE_HEADER, MPI_ELEM, MPI_ELEM, "native", MPI_INFO_NULL);
+        MPI_File_read_all(f->fh, X, 0, MPI_ELEM, MPI_STATUS_IGNORE);
+        return;
+    }
+    MPI_File_set_view(f->fh, MFILE_HEADER, MPI_ELEM, file_type, "native", MPI_INFO_NULL);
+    MPI_File_read_all(f->fh, X, 1, mem_type, MPI_STATUS_IGNORE);
+    MPI_Type_free(&file_type);
+    MPI_Type_free(&mem_type);
+}
+
+//Writes the block of every process in one collective call, straight to its
+//place in the file. Same parameters as mfile_read_all(). Elements past the
+//edges of the matrix are not written.
+void mfile_write_all(matrix_file *f, const elem *X, int ldx, int l, int c, int m, int n) {
+    MPI_Datatype file_type, mem_type;
+    if(block_types(f, ldx, l, c, m, n, &file_type, &mem_type) == 0) {
+        MPI_File_set_view(f->fh, MFILE_HEADER, MPI_ELEM, MPI_ELEM, "native", MPI_INFO_NULL);
+        MPI_File_write_all(f->fh, (void *)X, 0, MPI_ELEM, MPI_STATUS_IGNORE);
+        return;
+    }
+    MPI_File_set_view(f->fh, MFILE_HEADER, MPI_ELEM, file_type, "native", MPI_INFO_NULL);
+    MPI_File_write_all(f->fh, (void *)X, 1, mem_type, MPI_STATUS_IGNORE);
+    MPI_Type_free(&file_type);
+    MPI_Type_free(&mem_type);
+}
+
+//Writes tile (ti, tj), held in T x T buffer X, with a single independent
+//call. For drivers whose processes finish their tiles at different times.
+void mfile_write_tile(matrix_file *f, const elem *X, int ti, int tj) {
+    MPI_Offset off = MFILE_HEADER + (MPI_Offset)tile_offset(f, ti, tj)*sizeof(elem);
+    MPI_File_write_at(f->fh, off, (void *)X, f->tile*f->tile, MPI_ELEM, MPI_STATUS_IGNORE);
+}
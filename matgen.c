@@ -0,0 +1,48 @@
+//Writes the matrix the drivers would synthesize to a matrix file, so runs
+//reading their operands from files can be checked against the usual ones.
+//Example use:
+//matgen a.mat 50000 30000 0
+//matgen b.mat 30000 40000 2 1024
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mmulti.h"
+
+int main(int argc, char **argv) {
+    matrix_file f;
+    int rows, cols, offset;
+    int tile = MFILE_TILE;
+    int ti, tj;
+
+    if(argc < 5 || argc > 6) {
+        printf("Usage: %s FILE ROWS COLS OFFSET [TILE]\n", argv[0]);
+        exit(1);
+    }
+    rows = atoi(argv[2]);
+    cols = atoi(argv[3]);
+    offset = atoi(argv[4]);
+    if(argc == 6) {
+        tile = atoi(argv[5]);
+    }
+    if(rows <= 0 || cols <= 0 || tile <= 0) {
+        printf("Dimensions must be positive.\n");
+        exit(1);
+    }
+
+    if(mfile_create(&f, argv[1], rows, cols, tile) != 0) {
+        exit(1);
+    }
+    //Tile by tile, so the matrix never has to fit in memory.
+    for(ti=0; ti*tile<rows; ti++) {
+        for(tj=0; tj*tile<cols; tj++) {
+            block_init(mfile_tile(&f, ti, tj), tile, tile, rows, cols,
+                       ti*tile, tj*tile, offset);
+            mfile_release(&f, ti, tj);
+        }
+    }
+    mfile_close(&f);
+    printf("%dx%d %s matrix written to %s in %dx%d tiles.\n",
+           rows, cols, ELEM_NAME, argv[1], tile, tile);
+    return 0;
+}
@@ -1,10 +1,23 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "mmulti.h"
+
+//Submatrices with this number of lines/colums or less are handed to the
+//tiled leaf kernel. Values below 2 recurse all the way down to the 2x2 base
+//case.
+int mmulti_cutoff = MMULTI_CUTOFF;
+
+//When set, mmulti() uses the Strassen-Winograd recursion of strassen.c
+//(7 products per level) instead of the classical 8 product one.
+int mmulti_strassen = 0;
 
 
 //Initializes a matrix containing sequential numbers between 0+offset and 8+offset.
-void matrix_init(int *M, int size, int offset) {
+void matrix_init(elem *M, int size, int offset) {
     int i,j,n;
     n=0;
     for(i=0; i<size; i++) {
@@ -15,7 +28,23 @@ void matrix_init(int *M, int size, int offset) {
     }
 }
 
-void naive_multi(int *A, int *B, int *C, int size) {
+//Initializes the m x n matrix M with the elements of lines l to l+m-1 and
+//colums c to c+n-1 of the rows x cols matrix matrix_init() would build.
+//Elements past the edges of that matrix are zeros, which pads it.
+void block_init(elem *M, int m, int n, int rows, int cols, int l, int c, int offset) {
+    int i,j;
+    for(i=0; i<m; i++) {
+        for(j=0; j<n; j++) {
+            if(l+i < rows && c+j < cols) {
+                M[i*n + j] = (int)(((long long)(l+i)*cols + c+j)%9) + offset;
+            } else {
+                M[i*n + j] = 0;
+            }
+        }
+    }
+}
+
+void naive_multi(elem *A, elem *B, elem *C, int size) {
     int i, j, k;
     for(i=0; i<size; i++) {
         for(j=0; j<size; j++) {
@@ -27,19 +56,75 @@ void naive_multi(int *A, int *B, int *C, int size) {
     }
 }
 
-void matrix_alloc(int **ptr, int size) {
-    (*ptr) =  malloc(size*size*sizeof(int));
+void matrix_alloc(elem **ptr, int size) {
+    matrix_alloc_rect(ptr, size, size);
+}
+
+void matrix_alloc_rect(elem **ptr, int rows, int cols) {
+    double ts = trace_now();
+    (*ptr) =  malloc((size_t)rows*cols*sizeof(elem));
     if((*ptr)==NULL) {
         printf("malloc failed!\n");
         exit(1);
     }
+    trace_span(TRACE_ALLOC, ts, -1, (long)rows*cols*sizeof(elem));
 }
 
-void print_matrix(int *M, int size) {
+//Processes sharing the memory of this node, split off MPI_COMM_WORLD the
+//first time it is needed.
+static MPI_Comm node_comm = MPI_COMM_NULL;
+
+MPI_Comm node_comm_get() {
+    if(node_comm == MPI_COMM_NULL) {
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0,
+                            MPI_INFO_NULL, &node_comm);
+    }
+    return node_comm;
+}
+
+//Allocates a rows x cols matrix once per node, in an MPI-3 shared memory
+//window every process of the node maps. Collective over the node.
+//Returns 1 on the process that must fill it, the first one of the node,
+//and 0 on the others, which must not write to it.
+int matrix_alloc_shared(elem **ptr, int rows, int cols, MPI_Win *win) {
+    MPI_Comm comm = node_comm_get();
+    MPI_Aint size;
+    int unit, node_rank;
+    double ts = trace_now();
+    MPI_Comm_rank(comm, &node_rank);
+    size = (node_rank == 0) ? (MPI_Aint)rows*cols*sizeof(elem) : 0;
+    if(MPI_Win_allocate_shared(size, sizeof(elem), MPI_INFO_NULL, comm,
+                               ptr, win) != MPI_SUCCESS) {
+        printf("MPI_Win_allocate_shared failed!\n");
+        exit(1);
+    }
+    //Every process points at the pages of the first one.
+    MPI_Win_shared_query(*win, 0, &size, &unit, ptr);
+    trace_span(TRACE_ALLOC, ts, -1, (long)size);
+    return node_rank == 0;
+}
+
+//Makes what the first process of the node wrote to the matrix of win
+//visible to the others. Collective over the node, to be called once the
+//matrix is filled.
+void matrix_share(MPI_Win win) {
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+    MPI_Win_sync(win);
+    MPI_Barrier(node_comm_get());
+    MPI_Win_sync(win);
+    MPI_Win_unlock_all(win);
+}
+
+//Frees a matrix of matrix_alloc_shared(). Collective over the node.
+void matrix_free_shared(MPI_Win *win) {
+    MPI_Win_free(win);
+}
+
+void print_matrix(elem *M, int size) {
     int i, j;
     for(i=0; i<size; i++) {
         for(j=0; j<size; j++) {
-            printf("%3d, ", M[i*size+j]);
+            printf(ELEM_FMT ", ", M[i*size+j]);
         }
         printf("\n");
     }
@@ -51,14 +136,12 @@ C = matrix of dimensions (size_ab*2)*(size_ab*2) that will store the result of t
 cl cc = line and colum of the top left element of the submatrix of C we are currently working with.
 size_ab = size_ab*size_ab are the dimensions of both A and B
 */
-void msum(int *A, int *B, int *C, int cl, int cc, int size_ab) {
+void msum(elem *A, elem *B, elem *C, int cl, int cc, int size_ab) {
     int size_c = size_ab*2;
-    int i,j;
+    int i;
     for(i=0; i<size_ab; i++) {
-        for(j=0; j<size_ab; j++) {
-            //Clc = Alc + Blc
-            C[(cl+i)*size_c + cc+j] = A[i*size_ab + j]+B[i*size_ab + j];
-        }
+        //Clc = Alc + Blc, one line at a time
+        row_sum(&A[i*size_ab], &B[i*size_ab], &C[(cl+i)*size_c + cc], size_ab);
     }
 }
 
@@ -88,71 +171,122 @@ int simple_pow(int b, int p) {
     return res;
 }
 
-void mmulti(int *A, int *B,
+void mmulti(elem *A, elem *B,
             int al, int ac,
             int bl, int bc,
-            int *C, int s, int size) {
+            elem *C, int s, int size) {
     //printf("s, size: %d, %d\n", s, size);
+    if(mmulti_strassen) {
+        strassen_multi(&A[al*size + ac], size, &B[bl*size + bc], size, C, s, s);
+        return;
+    }
+    int i;
+    for(i=0; i<s*s; i++) {
+        C[i] = 0;
+    }
+    mmulti_acc(&A[al*size + ac], size, &B[bl*size + bc], size, C, s, s);
+}
+
+/*
+Params:
+A = pointer to the top left element of the current submatrix of A.
+lda = distance between two consecutive lines of A.
+B = pointer to the top left element of the current submatrix of B.
+ldb = distance between two consecutive lines of B.
+C = pointer to the top left element of the submatrix of C receiving the
+result.
+ldc = distance between two consecutive lines of C.
+s = size of the submatrices at this point in the recursion.
+Computes C += A*B. Both products of a quadrant of C accumulate straight into
+it, so the recursion needs no temporaries at all. Odd dimensions can't be
+split in halves and go to the leaf kernel as they are.
+Built with OpenMP and called from parallel_multi(), every quadrant of a
+level above the cutoff becomes a task. Its two products stay in sequence
+since they write the same quadrant, the four quadrants run concurrently.
+*/
+void mmulti_acc(const elem *A, int lda, const elem *B, int ldb,
+                elem *C, int ldc, int s) {
+    if(s <= mmulti_cutoff || (s > 2 && s%2)) {
+        tiled_multi_acc(A, lda, B, ldb, C, ldc, s, s, s);
+        return;
+    }
     if(s==2) {
-        //printf("test\n");
         //Regular multiplication for small 2x2 matrix
-        //printf("al = %d, ac = %d, bl = %d, bc = %d\n", al, ac, bl, bc);
-        
-        int a11 = A[al*size + ac];
-        int a12 = A[al*size + ac+1];
-        int a21 = A[(al+1)*size + ac];
-        int a22 = A[(al+1)*size + ac+1];
-        //printf("%d,%d\n%d,%d\n\n", a11, a12, a21, a22);
+        elem a11 = A[0];
+        elem a12 = A[1];
+        elem a21 = A[lda];
+        elem a22 = A[lda+1];
         
-        //printf("test2\n");
-        int b11 = B[bl*size + bc];
-        int b12 = B[bl*size + bc+1];
-        int b21 = B[(bl+1)*size + bc];
-        int b22 = B[(bl+1)*size + bc+1];
-        //printf("%d,%d\n%d,%d\n\n", b11, b12, b21, b22);
+        elem b11 = B[0];
+        elem b12 = B[1];
+        elem b21 = B[ldb];
+        elem b22 = B[ldb+1];
         
-        //printf("test3\n");
-        C[0] = a11*b11 + a12*b21;
-        //printf("test4\n");
-        C[1] = a11*b12 + a12*b22;
-        //printf("test5\n");
-        C[2] = a21*b11 + a22*b21;
-        //printf("test6\n");
-        C[3] = a21*b12 + a22*b22;
-        //printf("test7\n");
+        C[0]     += a11*b11 + a12*b21;
+        C[1]     += a11*b12 + a12*b22;
+        C[ldc]   += a21*b11 + a22*b21;
+        C[ldc+1] += a21*b12 + a22*b22;
         return;
     }
-    //printf("despair\n");
     int half = s/2;
+    const elem *A11 = A;
+    const elem *A12 = A + half;
+    const elem *A21 = A + half*lda;
+    const elem *A22 = A + half*lda + half;
+    const elem *B11 = B;
+    const elem *B12 = B + half;
+    const elem *B21 = B + half*ldb;
+    const elem *B22 = B + half*ldb + half;
     
-    int *tempM1;
-    int *tempM2;
-    //Pass pointer to the pointer so that the function can allocate.
-    matrix_alloc(&tempM1, half);
-    matrix_alloc(&tempM2, half);
-    
-    mmulti(A, B, al, ac, bl, bc, tempM1, half, size); //A11B11
-    mmulti(A, B, al, ac+half, bl+half, bc, tempM2, half, size); //A12B21
-    msum(tempM1, tempM2, C, 0, 0, half); //A11B11+A12B21=C11
-    //printf("despair1\n");
-    
-    mmulti(A, B, al, ac, bl, bc+half, tempM1, half, size); //A11B12
-    mmulti(A, B, al, ac+half, bl+half, bc+half, tempM2, half, size); //A12B22
-    msum(tempM1, tempM2, C, 0, half, half); //A11B12+A12B22=2C12
-    //printf("despair2\n");
-    
-    mmulti(A, B, al+half, ac, bl, bc, tempM1, half, size); //A21B11
-    mmulti(A, B, al, ac+half, bl+half, bc, tempM2, half, size); //A12B21
-    msum(tempM1, tempM2, C, half, 0, half); //A21B11+A22B21=2C21
-    //printf("despair3\n");
-    
-    mmulti(A, B, al+half, ac, bl, bc+half, tempM1, half, size); //A21B12
-    mmulti(A, B, al+half, ac+half, bl+half, bc+half, tempM2, half, size); //A22B22
-    msum(tempM1, tempM2, C, half, half, half); //A21B12+A22B22=2C22
-    //printf("despair4\n");
-    
-    free(tempM1);
-    free(tempM2);
+#ifdef _OPENMP
+    #pragma omp task
+#endif
+    {
+    mmulti_acc(A11, lda, B11, ldb, C, ldc, half);                   //C11 += A11B11
+    mmulti_acc(A12, lda, B21, ldb, C, ldc, half);                   //C11 += A12B21
+    }
+#ifdef _OPENMP
+    #pragma omp task
+#endif
+    {
+    mmulti_acc(A11, lda, B12, ldb, C + half, ldc, half);            //C12 += A11B12
+    mmulti_acc(A12, lda, B22, ldb, C + half, ldc, half);            //C12 += A12B22
+    }
+#ifdef _OPENMP
+    #pragma omp task
+#endif
+    {
+    mmulti_acc(A21, lda, B11, ldb, C + half*ldc, ldc, half);        //C21 += A21B11
+    mmulti_acc(A22, lda, B21, ldb, C + half*ldc, ldc, half);        //C21 += A22B21
+    }
+    mmulti_acc(A21, lda, B12, ldb, C + half*ldc + half, ldc, half); //C22 += A21B12
+    mmulti_acc(A22, lda, B22, ldb, C + half*ldc + half, ldc, half); //C22 += A22B22
+#ifdef _OPENMP
+    #pragma omp taskwait
+#endif
+}
+
+//Computes C = A*B for the s x s operands A and B, using every thread of the
+//process when built with OpenMP (OMP_NUM_THREADS sets how many). This lets a
+//single process per node, or per socket, do the work of many, sharing one
+//copy of A and B. Otherwise, or with a single thread, this is tiled_multi().
+void parallel_multi(const elem *A, int lda, const elem *B, int ldb,
+                    elem *C, int ldc, int s) {
+#ifdef _OPENMP
+    if(omp_get_max_threads() > 1 && s > mmulti_cutoff) {
+        int i;
+        //Picked before the threads start so they never race on it.
+        kernel_current();
+        for(i=0; i<s; i++) {
+            memset(&C[i*ldc], 0, s*sizeof(elem));
+        }
+        #pragma omp parallel
+        #pragma omp single
+        mmulti_acc(A, lda, B, ldb, C, ldc, s);
+        return;
+    }
+#endif
+    tiled_multi(A, lda, B, ldb, C, ldc, s, s, s);
 }
 
 /*
@@ -4,14 +4,336 @@
 #include "mpi.h"
 
 
+//Element type of the matrices, fixed at build time by adding for instance
+//-DELEM_TYPE=ELEM_INT64 to the mpicc line. Every kernel, buffer and message
+//is specialized for it at compile time: there is no dispatch on the type.
+//int32 overflows once K*max(A)*max(B) passes 2^31, int64 is the choice
+//for integer workloads with large K.
+#define ELEM_INT32 0
+#define ELEM_INT64 1
+#define ELEM_FLOAT 2
+#define ELEM_DOUBLE 3
+
+#ifndef ELEM_TYPE
+#define ELEM_TYPE ELEM_INT32
+#endif
+
+#if ELEM_TYPE == ELEM_INT32
+typedef int elem;
+#define MPI_ELEM MPI_INT
+#define ELEM_FMT "%3d"
+#define ELEM_NAME "int32"
+#elif ELEM_TYPE == ELEM_INT64
+typedef long long elem;
+#define MPI_ELEM MPI_LONG_LONG
+#define ELEM_FMT "%3lld"
+#define ELEM_NAME "int64"
+#elif ELEM_TYPE == ELEM_FLOAT
+typedef float elem;
+#define MPI_ELEM MPI_FLOAT
+#define ELEM_FMT "%3g"
+#define ELEM_NAME "float"
+#elif ELEM_TYPE == ELEM_DOUBLE
+typedef double elem;
+#define MPI_ELEM MPI_DOUBLE
+#define ELEM_FMT "%3g"
+#define ELEM_NAME "double"
+#else
+#error "Unknown ELEM_TYPE"
+#endif
+
+
+//Register tile of the leaf kernel micro-kernel (lines x colums of C).
+#define MR 4
+#define NR 16
+
+//Default cache blocking of the leaf kernel, in elements.
+//MC x KC block of A is sized for L2, KC x NC panel of B for L3.
+#define MC_DEFAULT 128
+#define KC_DEFAULT 256
+#define NC_DEFAULT 2048
+
+//Default dimension at which mmulti() stops recursing and calls the
+//leaf kernel.
+#define MMULTI_CUTOFF 256
+
+//Tuning profile loaded at startup, unless MMULTI_PROFILE names another one
+//(see config_load_profile()).
+#define DEFAULT_PROFILE "mmulti.tune"
+
+//Default dimension at or below which the Strassen-Winograd recursion
+//switches back to the classical leaf kernel.
+#define STRASSEN_CUTOFF 512
+
+//Leaf kernel variants, from the scalar fallback to the widest SIMD one.
+#if defined(__x86_64__) || defined(__i386__)
+enum { KERNEL_SCALAR, KERNEL_SSE41, KERNEL_AVX2, KERNEL_AVX512, KERNEL_COUNT };
+#else
+enum { KERNEL_SCALAR, KERNEL_COUNT };
+#endif
+
+typedef void (*micro_kernel_fn)(int kc, const elem *Ap, const elem *Bp,
+                                elem *C, int ldc, int mr, int nr);
+typedef void (*row_sum_fn)(const elem *a, const elem *b, elem *c, int n);
+
+//Most products a dividing process may collect from its children.
+#define MAX_PRODUCTS 8
+
+//Row panels results are sent back in, when their dimension allows it.
+#define RESULT_PANELS 8
+
+//Kinds of spans recorded by trace.c.
+enum { TRACE_SEND, TRACE_RECV, TRACE_WAIT, TRACE_LEAF, TRACE_MSUM, TRACE_ALLOC,
+       TRACE_IO, TRACE_KINDS };
+
+//Tag of the first panel of a result, the others follow.
+#define RESULT_TAG 16
+
+//State of the collection of the products sent back by the children of a
+//dividing process (see collect.c).
+typedef struct {
+    int h;                              //Dimension of every product
+    int ldc;                            //Leading dimension of C
+    elem *quad[4];                      //C11, C12, C21, C22
+    int panels;                         //Panels every product comes in
+    int rows;                           //Lines of every panel
+    int filled[4][RESULT_PANELS];       //Panels already holding a result
+    int left[4][RESULT_PANELS];         //Products still to reduce into them
+    int n;                              //Number of products expected
+    int source[MAX_PRODUCTS];           //Process sending each product
+    int n_targets[MAX_PRODUCTS];
+    int target[MAX_PRODUCTS][3];        //Quadrants each product goes to
+    int sign[MAX_PRODUCTS][3];
+    int in_place[MAX_PRODUCTS];         //Received straight into its quadrant
+    int pending[4][RESULT_PANELS];      //1 + product in place not arrived yet
+    int nonblocking;
+    MPI_Datatype panel_type;            //One panel of a quadrant of C
+    elem *buffer[MAX_PRODUCTS];
+    MPI_Request request[MAX_PRODUCTS*RESULT_PANELS];
+    int dest;                           //Process C is streamed to, or -1
+    int sent[RESULT_PANELS];            //Panels of C already streamed
+    MPI_Datatype fwd_type;              //One panel of C
+    MPI_Request fwd_request[RESULT_PANELS];
+    int morton;                         //C in Morton layout (see morton.c)
+    size_t mark;
+} collector;
+
+//Bytes before the first tile of a matrix file, a whole number of pages.
+#define MFILE_HEADER 4096
+
+//Default lines/colums of the tiles of matrix files.
+#define MFILE_TILE 512
+
+//Matrix file mapped in memory (see matfile.c).
+typedef struct {
+    int fd;
+    int rows;
+    int cols;
+    int tile;                           //Lines/colums of every tile
+    int tiles_per_line;
+    int writable;
+    char *map;
+    size_t size;
+    elem *data;                         //First tile
+    MPI_File fh;                        //When opened for MPI-IO
+} matrix_file;
+
+//Options of mm_plan_create().
+#define MM_THREADS 1                    //Leaves on every OpenMP thread
+#define MM_STRASSEN 2                   //Strassen-Winograd on square leaves
+
+//Most divisions a plan performs: 8^d processes have to fit in an int.
+#define PLAN_LEVELS 11
+
+//Child a process hands one of its 7 sub-products to at one level of a plan.
+typedef struct {
+    int rank;
+    int rows;                           //Its product is rows x cols
+    int cols;
+    size_t a_off;                       //First element of its blocks of A, B
+    size_t b_off;                       //and C in those of the process
+    size_t c_off;
+    MPI_Datatype a_type;                //Its blocks of A and B
+    MPI_Datatype b_type;
+    MPI_Datatype c_type;                //Its quadrant of C, if received in place
+} plan_child;
+
+//Multiplication of fixed shapes, set up once and run many times (see plan.c).
+typedef struct {
+    int m;                              //A is m x k, B is k x n
+    int k;
+    int n;
+    MPI_Comm comm;                      //Own copy, or MPI_COMM_NULL if local
+    int my_rank;
+    int divisions;                      //Depth of the tree
+    int join;                           //Level the process gets its block at,
+                                        //-1 if it has no part in the tree
+    int father;
+    int dest;                           //Process its product goes to
+    int sibling;                        //Process whose product it adds, or -1
+    int rows;                           //Block of the process: rows x inner
+    int inner;                          //times inner x cols
+    int cols;
+    int lda;
+    int ldb;
+    int ldc;
+    int leaf_rows;                      //Product computed by the process
+    int leaf_inner;
+    int leaf_cols;
+    plan_child child[PLAN_LEVELS][7];
+    elem *T[PLAN_LEVELS];               //Product added to C11 at every level
+    elem *S;                            //Product of the sibling
+    elem *A;                            //Blocks of the processes but the root
+    elem *B;
+    elem *C;
+    MPI_Request send_req[PLAN_LEVELS*14];
+    MPI_Request recv_req[PLAN_LEVELS][4];
+    MPI_Request sibling_req;
+    int strassen;
+    int threads;
+    size_t workspace;                   //Arena of every thread, in elements
+} mm_plan;
+
+extern int tile_mc;
+extern int tile_kc;
+extern int tile_nc;
+extern int mmulti_cutoff;
+extern int mmulti_strassen;
+extern int strassen_cutoff;
+extern int cfg_m;
+extern int cfg_k;
+extern int cfg_n;
+extern int cfg_divisions;
+extern char *cfg_a_file;
+extern char *cfg_b_file;
+extern char *cfg_c_file;
+extern char *cfg_trace_file;
+extern char *cfg_spool_dir;
+extern int trace_on;
 
 int simple_pow(int b, int p);
-void matrix_init(int *M, int size, int offset);
-void naive_multi(int *A, int *B, int *C, int size);
-void matrix_alloc(int **ptr, int size);
-void print_matrix(int *M, int size);
-void msum(int *A, int *B, int *C, int cl, int cc, int size_ab);
-void mmulti(int *A, int *B,
+void matrix_init(elem *M, int size, int offset);
+void block_init(elem *M, int m, int n, int rows, int cols, int l, int c, int offset);
+void naive_multi(elem *A, elem *B, elem *C, int size);
+void matrix_alloc(elem **ptr, int size);
+void matrix_alloc_rect(elem **ptr, int rows, int cols);
+MPI_Comm node_comm_get();
+int matrix_alloc_shared(elem **ptr, int rows, int cols, MPI_Win *win);
+void matrix_share(MPI_Win win);
+void matrix_free_shared(MPI_Win *win);
+void print_matrix(elem *M, int size);
+void msum(elem *A, elem *B, elem *C, int cl, int cc, int size_ab);
+void mmulti(elem *A, elem *B,
             int al, int ac,
             int bl, int bc,
-            int *C, int s, int size);
+            elem *C, int s, int size);
+void mmulti_acc(const elem *A, int lda, const elem *B, int ldb,
+                elem *C, int ldc, int s);
+void parallel_multi(const elem *A, int lda, const elem *B, int ldb,
+                    elem *C, int ldc, int s);
+void tiled_multi(const elem *A, int lda, const elem *B, int ldb,
+                 elem *C, int ldc, int m, int n, int k);
+void tiled_multi_acc(const elem *A, int lda, const elem *B, int ldb,
+                     elem *C, int ldc, int m, int n, int k);
+void strassen_multi(const elem *A, int lda, const elem *B, int ldb,
+                    elem *C, int ldc, int n);
+void mat_copy(const elem *X, int ldx, elem *Z, int ldz, int n);
+void mat_addsub(const elem *X, int ldx, const elem *Y, int ldy,
+                elem *Z, int ldz, int n, int sign);
+
+void to_morton(const elem *X, int ldx, elem *Z, int n);
+void from_morton(const elem *Z, elem *X, int ldx, int n);
+size_t morton_offset(int l, int c, int s, int n);
+void morton_acc(const elem *A, const elem *B, elem *C, int n);
+void morton_multi(const elem *A, const elem *B, elem *C, int n);
+void msum_morton(const elem *A, const elem *B, elem *C, int q, int size_ab,
+                 int first, int rows);
+
+int config_init(int argc, char **argv, int dim, int divisions, int quiet);
+int config_padded(int m);
+void config_report(const char *driver, double seconds);
+char *config_profile_path();
+int config_load_profile(int quiet);
+int config_save_profile(int divisions);
+
+mm_plan *mm_plan_create(int m, int k, int n, int elem_type, MPI_Comm comm,
+                        int options);
+void mm_execute(mm_plan *p, const elem *A, const elem *B, elem *C);
+void mm_plan_destroy(mm_plan *p);
+
+void trace_init();
+double trace_now();
+void trace_span(int kind, double start, int peer, long bytes);
+void trace_write();
+
+void ws_reserve(size_t n);
+elem *ws_alloc(size_t n);
+size_t ws_mark();
+void ws_release(size_t mark);
+int ws_idle();
+void ws_free();
+size_t ws_round(size_t n);
+size_t tiled_workspace(int m, int n, int k);
+size_t mmulti_workspace(int s);
+size_t strassen_workspace(int n);
+void mem_peak_reset();
+long mem_peak_kib();
+
+void send_block(const elem *X, int ldx, int n, int dest, int tag);
+void recv_block(elem *X, int ldx, int n, int source, int tag);
+void recv_rect(elem *X, int ldx, int m, int n, int source, int tag);
+int result_panels(int n);
+void send_result(const elem *C, int ldc, int n, int dest);
+void collect_init(collector *col, elem *C, int ldc, int h, int nonblocking);
+void collect_init_morton(collector *col, elem *C, int h, int nonblocking);
+int collect_expect(collector *col, int source);
+void collect_target(collector *col, int p, int q, int sign);
+void collect_filled(collector *col, int q);
+void collect_forward(collector *col, int dest);
+size_t collect_workspace(int h, int n, int nonblocking);
+void collect_start(collector *col);
+void collect_finish(collector *col);
+size_t pair_workspace(int n);
+void pair_reduce(elem *C, int n, int sibling, int dest);
+void result_window_open(elem **R, int n, MPI_Win *win);
+void result_accumulate(const elem *X, int ldx, int n, MPI_Aint disp, int ldr,
+                       MPI_Win win);
+void result_window_close(MPI_Win *win);
+
+int mfile_create(matrix_file *f, const char *path, int rows, int cols, int tile);
+int mfile_open(matrix_file *f, const char *path, int writable);
+void mfile_close(matrix_file *f);
+elem *mfile_tile(matrix_file *f, int ti, int tj);
+void mfile_release(matrix_file *f, int ti, int tj);
+void mfile_tile_product(matrix_file *A, matrix_file *B, int ti, int tj,
+                        elem *C, int ldc, int rows, int cols);
+size_t mfile_workspace(matrix_file *A);
+void ooc_multi(matrix_file *A, matrix_file *B, matrix_file *C);
+int mfile_popen(matrix_file *f, const char *path, int writable, MPI_Comm comm);
+int mfile_pcreate(matrix_file *f, const char *path, int rows, int cols, int tile,
+                  MPI_Comm comm);
+void mfile_pclose(matrix_file *f);
+void mfile_read_all(matrix_file *f, elem *X, int ldx, int l, int c, int m, int n);
+void mfile_write_all(matrix_file *f, const elem *X, int ldx, int l, int c, int m, int n);
+void mfile_write_tile(matrix_file *f, const elem *X, int ti, int tj);
+
+void kernel_init();
+int kernel_supported(int kernel);
+int kernel_select(int kernel);
+int kernel_current();
+char *kernel_name(int kernel);
+void row_sum(const elem *a, const elem *b, elem *c, int n);
+void micro_kernel_scalar(int kc, const elem *Ap, const elem *Bp,
+                         elem *C, int ldc, int mr, int nr);
+void row_sum_scalar(const elem *a, const elem *b, elem *c, int n);
+#if defined(__x86_64__) || defined(__i386__)
+void micro_kernel_sse41(int kc, const elem *Ap, const elem *Bp,
+                        elem *C, int ldc, int mr, int nr);
+void micro_kernel_avx2(int kc, const elem *Ap, const elem *Bp,
+                       elem *C, int ldc, int mr, int nr);
+void micro_kernel_avx512(int kc, const elem *Ap, const elem *Bp,
+                         elem *C, int ldc, int mr, int nr);
+void row_sum_sse41(const elem *a, const elem *b, elem *c, int n);
+void row_sum_avx2(const elem *a, const elem *b, elem *c, int n);
+void row_sum_avx512(const elem *a, const elem *b, elem *c, int n);
+#endif
@@ -0,0 +1,144 @@
+/*
+Blocked Morton (Z-order) layout of square matrices.
+
+An n x n matrix is stored as its four quadrants one after the other, C11,
+C12, C21 then C22, each of them laid out the same way, down to the leaf
+blocks mmulti() would hand to the leaf kernel (n <= mmulti_cutoff, or odd),
+which are stored line by line. Every quadrant of every level of the
+recursion is then one contiguous block of memory: the recursion walks
+through memory in the order it works, whatever the cache and TLB sizes,
+and a sub-problem goes over MPI as a single contiguous message.
+
+Matrices are converted once with to_morton() and back with from_morton().
+Both sides must use the same mmulti_cutoff, since it sets the leaf blocks.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mmulti.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+//Blocks of this dimension are stored line by line.
+static int morton_leaf(int n) {
+    return n <= mmulti_cutoff || n%2;
+}
+
+//Copies the n x n matrix X, whose lines are ldx elements apart, to Z in
+//Morton layout.
+void to_morton(const elem *X, int ldx, elem *Z, int n) {
+    int h = n/2;
+    size_t hh = (size_t)h*h;
+    if(morton_leaf(n)) {
+        mat_copy(X, ldx, Z, n, n);
+        return;
+    }
+    to_morton(X,              ldx, Z,        h);
+    to_morton(X + h,          ldx, Z + hh,   h);
+    to_morton(X + h*ldx,      ldx, Z + 2*hh, h);
+    to_morton(X + h*ldx + h,  ldx, Z + 3*hh, h);
+}
+
+//Copies the n x n matrix Z, in Morton layout, to X whose lines are ldx
+//elements apart.
+void from_morton(const elem *Z, elem *X, int ldx, int n) {
+    int h = n/2;
+    size_t hh = (size_t)h*h;
+    if(morton_leaf(n)) {
+        mat_copy(Z, n, X, ldx, n);
+        return;
+    }
+    from_morton(Z,        X,             ldx, h);
+    from_morton(Z + hh,   X + h,         ldx, h);
+    from_morton(Z + 2*hh, X + h*ldx,     ldx, h);
+    from_morton(Z + 3*hh, X + h*ldx + h, ldx, h);
+}
+
+//Offset of the s x s block at line l, colum c of an n x n matrix in Morton
+//layout. l and c must be multiples of s, as the blocks of the recursion are.
+size_t morton_offset(int l, int c, int s, int n) {
+    size_t off = 0;
+    while(n > s) {
+        int h = n/2;
+        off += (size_t)((l >= h)*2 + (c >= h))*h*h;
+        l %= h;
+        c %= h;
+        n = h;
+    }
+    return off;
+}
+
+/*
+Params:
+A, B = n x n operands in Morton layout.
+C = n x n result in Morton layout.
+Computes C += A*B. Same recursion as mmulti_acc(), but every quadrant is
+found at a fixed offset of its matrix instead of through a leading
+dimension. Built with OpenMP, quadrants of C run as tasks.
+*/
+void morton_acc(const elem *A, const elem *B, elem *C, int n) {
+    int h = n/2;
+    size_t hh = (size_t)h*h;
+    if(morton_leaf(n)) {
+        tiled_multi_acc(A, n, B, n, C, n, n, n, n);
+        return;
+    }
+#ifdef _OPENMP
+    #pragma omp task
+#endif
+    {
+    morton_acc(A,        B,        C,        h);    //C11 += A11B11
+    morton_acc(A + hh,   B + 2*hh, C,        h);    //C11 += A12B21
+    }
+#ifdef _OPENMP
+    #pragma omp task
+#endif
+    {
+    morton_acc(A,        B + hh,   C + hh,   h);    //C12 += A11B12
+    morton_acc(A + hh,   B + 3*hh, C + hh,   h);    //C12 += A12B22
+    }
+#ifdef _OPENMP
+    #pragma omp task
+#endif
+    {
+    morton_acc(A + 2*hh, B,        C + 2*hh, h);    //C21 += A21B11
+    morton_acc(A + 3*hh, B + 2*hh, C + 2*hh, h);    //C21 += A22B21
+    }
+    morton_acc(A + 2*hh, B + hh,   C + 3*hh, h);    //C22 += A21B12
+    morton_acc(A + 3*hh, B + 3*hh, C + 3*hh, h);    //C22 += A22B22
+#ifdef _OPENMP
+    #pragma omp taskwait
+#endif
+}
+
+//C = A*B for n x n matrices in Morton layout, on every thread of the
+//process when built with OpenMP.
+void morton_multi(const elem *A, const elem *B, elem *C, int n) {
+    memset(C, 0, (size_t)n*n*sizeof(elem));
+#ifdef _OPENMP
+    if(omp_get_max_threads() > 1 && !morton_leaf(n)) {
+        //Picked before the threads start so they never race on it.
+        kernel_current();
+        #pragma omp parallel
+        #pragma omp single
+        morton_acc(A, B, C, n);
+        return;
+    }
+#endif
+    morton_acc(A, B, C, n);
+}
+
+//Morton counterpart of msum(): lines first to first+rows-1 of quadrant q
+//(0=C11, 1=C12, 2=C21, 3=C22) of the (2*size_ab) x (2*size_ab) C = the same
+//lines of A + B. The quadrant being contiguous, this is one sweep through
+//the three blocks. A may be the quadrant itself.
+void msum_morton(const elem *A, const elem *B, elem *C, int q, int size_ab,
+                 int first, int rows) {
+    size_t off = (size_t)first*size_ab;
+    C += (size_t)q*size_ab*size_ab;
+    row_sum(&A[off], &B[off], &C[off], rows*size_ab);
+}
@@ -1,5 +1,5 @@
 //Example use:
-//ladrun -np 73 mpi_mmulti
+//ladrun -np 73 mpi_mmulti -n 8192 -d 2
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -20,31 +20,63 @@ Examples:
     2       1           9
     3       2           73
     4       3           585
+
+The shape of the matrices and the number of divisions are read at runtime
+(see config.c). Matrices are padded with zeros to a square that can be
+halved that many times.
 */
 
-//Dimensions of matrices being multiplied
-//will be 2^MATRIX_DIM_EXP.
-#define MATRIX_DIM_EXP 13
+//Dimension of the matrices being multiplied, unless configured otherwise.
+#define DEFAULT_DIM (1<<13)
+
+//Divisions performed before conquering, unless configured otherwise.
+#define DEFAULT_DIVISIONS 2
+
+//Set to 1 so that only the root holds the whole A and B. Every other process
+//then receives from its father just the blocks of A and B its job needs, so
+//its memory grows with its share of the job instead of the global size.
+#define DISTRIBUTED_INPUT 0
 
-//This number defines how many divisions should be
-//performed before conquering.
-#define N_OF_DIVISIONS 2
+//Set to 1 to keep a single copy of A and B per node, in MPI-3 shared memory
+//filled by the first process of the node and read by all of them, instead
+//of one copy per process. Only used when DISTRIBUTED_INPUT is 0.
+#define SHARED_INPUT 0
 
-//Number of lines/colums of matrices being multiplied.
-#define MATRIX_DIM (1<<MATRIX_DIM_EXP)
+//Set to 1 to reduce children products in the order they arrive, with one
+//receive posted per child, or to 0 to receive them one at a time in a fixed
+//order through a single buffer.
+#define NONBLOCKING_COLLECT 1
 
-//Matrices with this number of lines/colums should be conquered
-#define DELTA (1<<(MATRIX_DIM_EXP - N_OF_DIVISIONS))
+//Set to 1 to keep A, B and C in Morton layout (see morton.c) from the start
+//to the end of the multiplication. Every block a process works on or sends
+//is then contiguous.
+#define MORTON_LAYOUT 0
+
+//Set to 1 to have the two children whose products go to the same quadrant
+//add them together before sending the sum to their father (see
+//pair_reduce()), which then receives 4 quadrants instead of 8 products.
+#define PAIR_REDUCTION 1
+
+//Set to 1 to assemble the result with one-sided communication: the root
+//exposes its C as an RMA window and every leaf adds its product straight
+//into it (see result_window_open()), instead of sending it to its father to
+//be reduced and relayed level by level.
+#define RMA_RESULT 0
 
 
 void main(int argc, char** argv) {
     
     //A and B are square matrices of same size
-    int *A;
-    int *B;
+    elem *A;
+    elem *B;
     
     //C points to the resulting matrix
-    int *C;
+    elem *C = NULL;
+    
+    //With RMA_RESULT, result of the root that every leaf adds its product
+    //to, and its window.
+    elem *C_all;
+    MPI_Win win_c;
     
 	//These numbers store the current line and colum of the top left elements
 	//of the submatrices of A and B we are working with in the current level
@@ -57,38 +89,73 @@ void main(int argc, char** argv) {
 	//Current dimensions of the matrices we are working with;
 	int curr_dim;
 	
+	//Number of lines/colums of the (padded) matrices being multiplied.
+	int matrix_dim;
+	
+	//Matrices with this number of lines/colums should be conquered.
+	int delta;
+	
+	//Distance between two consecutive lines of the A and B this process
+	//holds: the original matrices or, with DISTRIBUTED_INPUT, the blocks
+	//received from the father.
+	int ld_ab;
+	
 	//Message buffer for the above numbers.
-	int div_buffer[5] = {al, ac, bl, bc, MATRIX_DIM};
+	int div_buffer[5];
+	
+	//Line of the whole A and colum of the whole B the blocks this process
+	//holds start at, al and bc being relative to them. 0 unless the
+	//process received its blocks from its father.
+	int ol = 0, oc = 0;
 	
 	int half;
 	int father;
+	//Process this one sends its result to: its father, or with
+	//PAIR_REDUCTION the first of its pair of siblings. The first of a pair
+	//receives the result of its sibling (-1 if none).
+	int dest = -1;
+	int sibling = -1;
 	int child1, child2, child3, child4,
 	    child5, child6, child7, child8;
 	    
 	//For execution time measuring.
-	double t1, t2;
+	double t1 = 0, t2 = 0;
 	
 	int i;
 	
+	//Set on the processes that fill A and B, and windows of A and B with
+	//SHARED_INPUT.
+	int fill_ab = 0;
+	MPI_Win win_a, win_b;
+	
+	int provided; //Thread support given by MPI.
 	int my_rank; //Process id.
 	int proc_n; //Total number of processes
 	MPI_Status status;
-    MPI_Init(&argc , &argv);
+    //Only the main thread calls MPI, threads of parallel_multi() don't.
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
     MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
     MPI_Comm_size(MPI_COMM_WORLD, &proc_n);
     
+    if(config_init(argc, argv, DEFAULT_DIM, DEFAULT_DIVISIONS, my_rank != 0) != 0) {
+        exit(1);
+    }
+    matrix_dim = config_padded(1<<cfg_divisions);
+    delta = matrix_dim >> cfg_divisions;
+    ld_ab = matrix_dim;
+    
     
     //===========================================
     //Test if the number of processes is correct
     int required_procs = 0;
-    for(i=0; i<=N_OF_DIVISIONS; i++) {
+    for(i=0; i<=cfg_divisions; i++) {
         required_procs += simple_pow(8, i);
     }
     if( proc_n != required_procs ) {
         if(my_rank == 0) {
             int req_procs = 
             printf("Error. required number of processes to perform %d divisions is %d.\n",
-                   N_OF_DIVISIONS, required_procs);
+                   cfg_divisions, required_procs);
             printf("Number of processes given by the user: %d.\n", proc_n);
             printf("Aborting.\n");
         }
@@ -97,13 +164,49 @@ void main(int argc, char** argv) {
     //============================================
     //Test passed
     
+    trace_init();
+    
+    //Blocks of the processes must be whole blocks of the Morton layout.
+    if(MORTON_LAYOUT && mmulti_cutoff > delta) {
+        if(my_rank == 0) {
+            printf("Cutoff %d is above the conquering point, using %d.\n",
+                   mmulti_cutoff, delta);
+        }
+        mmulti_cutoff = delta;
+    }
+    
+    if(SHARED_INPUT && !DISTRIBUTED_INPUT) {
+        fill_ab = matrix_alloc_shared(&A, matrix_dim, matrix_dim, &win_a);
+        matrix_alloc_shared(&B, matrix_dim, matrix_dim, &win_b);
+    } else if(!DISTRIBUTED_INPUT || my_rank == 0) {
+        matrix_alloc(&A, matrix_dim);
+        matrix_alloc(&B, matrix_dim);
+        fill_ab = 1;
+    }
+    if(fill_ab) {
+        block_init(A, matrix_dim, matrix_dim, cfg_m, cfg_k, 0, 0, 0);
+        block_init(B, matrix_dim, matrix_dim, cfg_k, cfg_n, 0, 0, 2);
+        if(MORTON_LAYOUT) {
+            //Converted through a copy, A and B may be shared.
+            elem *Z;
+            size_t bytes = (size_t)matrix_dim*matrix_dim*sizeof(elem);
+            matrix_alloc(&Z, matrix_dim);
+            to_morton(A, matrix_dim, Z, matrix_dim);
+            memcpy(A, Z, bytes);
+            to_morton(B, matrix_dim, Z, matrix_dim);
+            memcpy(B, Z, bytes);
+            free(Z);
+        }
+    }
+    if(SHARED_INPUT && !DISTRIBUTED_INPUT) {
+        matrix_share(win_a);
+        matrix_share(win_b);
+    }
     
-    matrix_alloc(&A, MATRIX_DIM);
-    matrix_alloc(&B, MATRIX_DIM);
-    matrix_init(A, MATRIX_DIM, 0);
-    matrix_init(B, MATRIX_DIM, 2);
+    if(RMA_RESULT) {
+        result_window_open(&C_all, matrix_dim, &win_c);
+    }
     
-    printf("[%d]start\n", my_rank);
     
     if ( my_rank != 0 ) { //not root
         
@@ -111,45 +214,89 @@ void main(int argc, char** argv) {
         //and also the size of the submatrices dimensions (same dimensions for both).
         //Receive some division of the job
         
+        double ts = trace_now();
         MPI_Recv(div_buffer, 5, MPI_INT, MPI_ANY_SOURCE, 1, MPI_COMM_WORLD, &status);
+        trace_span(TRACE_RECV, ts, status.MPI_SOURCE, sizeof(div_buffer));
         al = div_buffer[0];
         ac = div_buffer[1];
         bl = div_buffer[2];
         bc = div_buffer[3];
         curr_dim = div_buffer[4];
         father = status.MPI_SOURCE;
-        printf("[%d] received from %d. curr_dim = %d\n", my_rank, status.MPI_SOURCE, curr_dim);
+        dest = father;
+        if(PAIR_REDUCTION && !RMA_RESULT) {
+            //Children of a process are numbered by product, the two
+            //products of every quadrant one after the other.
+            if((my_rank-1)%2) {
+                dest = my_rank-1;
+            } else {
+                sibling = my_rank+1;
+            }
+        }
+        
+        if(DISTRIBUTED_INPUT) {
+            //The blocks of A and B of our job follow its description.
+            matrix_alloc(&A, curr_dim);
+            matrix_alloc(&B, curr_dim);
+            recv_block(A, curr_dim, curr_dim, father, 2);
+            recv_block(B, curr_dim, curr_dim, father, 2);
+            ol = al;
+            oc = bc;
+            al = ac = bl = bc = 0;
+            ld_ab = curr_dim;
+        }
 
         
     } else { //root
-        printf("Dimensions of the matrices: %dx%d\n", MATRIX_DIM, MATRIX_DIM);
-        printf("conquering point: %d\n", DELTA);
-        printf("Number of consecutive divisions to be performed before conquering: %d", N_OF_DIVISIONS);
+        printf("Dimensions of the %s matrices: %dx%d times %dx%d, padded to %dx%d\n",
+               ELEM_NAME, cfg_m, cfg_k, cfg_k, cfg_n, matrix_dim, matrix_dim);
+        printf("conquering point: %d\n", delta);
+        printf("Number of consecutive divisions to be performed before conquering: %d", cfg_divisions);
         printf("number of processes: %d\n\n", proc_n);
         //printf("matrix A:\n");
-        //print_matrix(A, MATRIX_DIM);
+        //print_matrix(A, matrix_dim);
         //printf("\nmatrix B:\n");
-        //print_matrix(B, MATRIX_DIM);
+        //print_matrix(B, matrix_dim);
         
-        curr_dim = MATRIX_DIM;
+        curr_dim = matrix_dim;
         t1 = MPI_Wtime();
     }
     
     
-    //Now that curr_dim is known we can allocate C.
-    matrix_alloc(&C, curr_dim);
+    //Now that curr_dim is known we can allocate C and size the workspace:
+    //dividing processes need the buffers receiving the four products that
+    //cannot land in place, conquering ones only need the packed panels of
+    //the leaf kernel. With RMA_RESULT, dividing processes hold no C.
+    //With PAIR_REDUCTION every product is received in place, and the first
+    //of a pair takes a buffer for the result of its sibling once done.
+    if (curr_dim <= delta) {
+        matrix_alloc(&C, curr_dim);
+        ws_reserve(tiled_workspace(curr_dim, curr_dim, curr_dim));
+    } else if(!RMA_RESULT) {
+        matrix_alloc(&C, curr_dim);
+        ws_reserve(collect_workspace(curr_dim/2, PAIR_REDUCTION ? 0 : 4,
+                                     NONBLOCKING_COLLECT));
+    }
+    if(sibling >= 0) {
+        ws_reserve(pair_workspace(curr_dim));
+    }
     
     
-    if (curr_dim <= DELTA) { //conquer
-        printf("[%d]: curr_dim = %d. Conquering.\n", my_rank, curr_dim);
-        mmulti(A, B, div_buffer[0], div_buffer[1],
-               div_buffer[2], div_buffer[3],
-               C, curr_dim, MATRIX_DIM);
-        printf("[%d]: mmulti done.\n", my_rank);
+    if (curr_dim <= delta) { //conquer
+        double ts = trace_now();
+        if(MORTON_LAYOUT) {
+            morton_multi(&A[morton_offset(al, ac, curr_dim, ld_ab)],
+                         &B[morton_offset(bl, bc, curr_dim, ld_ab)],
+                         C, curr_dim);
+        } else {
+            parallel_multi(&A[al*ld_ab + ac], ld_ab,
+                           &B[bl*ld_ab + bc], ld_ab,
+                           C, curr_dim, curr_dim);
+        }
+        trace_span(TRACE_LEAF, ts, -1, 0);
         
         
     } else { //divide
-        printf("[%d] dividing\n", my_rank);
         
         half = curr_dim/2;
         
@@ -162,15 +309,20 @@ void main(int argc, char** argv) {
         child7 = child6+1;
         child8 = child7+1;
         
-        int A11B11_buffer[5] = {al,      ac,      bl,      bc,      half};
-        int A12B21_buffer[5] = {al,      ac+half, bl+half, bc,      half};
-        int A11B12_buffer[5] = {al,      ac,      bl,      bc+half, half};
-        int A12B22_buffer[5] = {al,      ac+half, bl+half, bc+half, half};
-        int A21B11_buffer[5] = {al+half, ac,      bl,      bc,      half};
-        int A22B21_buffer[5] = {al+half, ac+half, bl+half, bc,      half};
-        int A21B12_buffer[5] = {al+half, ac,      bl,      bc+half, half};
-        int A22B22_buffer[5] = {al+half, ac+half, bl+half, bc+half, half};
+        //Lines of A and colums of B are sent as offsets in the whole
+        //matrices, which children place their result from.
+        int jl = ol + al;
+        int jc = oc + bc;
+        int A11B11_buffer[5] = {jl,      ac,      bl,      jc,      half};
+        int A12B21_buffer[5] = {jl,      ac+half, bl+half, jc,      half};
+        int A11B12_buffer[5] = {jl,      ac,      bl,      jc+half, half};
+        int A12B22_buffer[5] = {jl,      ac+half, bl+half, jc+half, half};
+        int A21B11_buffer[5] = {jl+half, ac,      bl,      jc,      half};
+        int A22B21_buffer[5] = {jl+half, ac+half, bl+half, jc,      half};
+        int A21B12_buffer[5] = {jl+half, ac,      bl,      jc+half, half};
+        int A22B22_buffer[5] = {jl+half, ac+half, bl+half, jc+half, half};
         
+        double ts = trace_now();
         MPI_Send (A11B11_buffer, 5, MPI_INT, child1, 1, MPI_COMM_WORLD);
         MPI_Send (A12B21_buffer, 5, MPI_INT, child2, 1, MPI_COMM_WORLD);
         MPI_Send (A11B12_buffer, 5, MPI_INT, child3, 1, MPI_COMM_WORLD);
@@ -179,6 +331,49 @@ void main(int argc, char** argv) {
         MPI_Send (A22B21_buffer, 5, MPI_INT, child6, 1, MPI_COMM_WORLD);
         MPI_Send (A21B12_buffer, 5, MPI_INT, child7, 1, MPI_COMM_WORLD);
         MPI_Send (A22B22_buffer, 5, MPI_INT, child8, 1, MPI_COMM_WORLD);
+        trace_span(TRACE_SEND, ts, -1, 8*sizeof(A11B11_buffer));
+        
+        if(DISTRIBUTED_INPUT) {
+            //Children hold none of A and B, send them the blocks they need.
+            //In Morton layout every block is contiguous, lines half apart.
+            int ld = ld_ab;
+            size_t hh = (size_t)half*half;
+            elem *A11 = &A[al*ld_ab + ac];
+            elem *A12 = A11 + half;
+            elem *A21 = A11 + half*ld_ab;
+            elem *A22 = A21 + half;
+            elem *B11 = &B[bl*ld_ab + bc];
+            elem *B12 = B11 + half;
+            elem *B21 = B11 + half*ld_ab;
+            elem *B22 = B21 + half;
+            if(MORTON_LAYOUT) {
+                ld = half;
+                A11 = &A[morton_offset(al, ac, curr_dim, ld_ab)];
+                A12 = A11 + hh;
+                A21 = A11 + 2*hh;
+                A22 = A11 + 3*hh;
+                B11 = &B[morton_offset(bl, bc, curr_dim, ld_ab)];
+                B12 = B11 + hh;
+                B21 = B11 + 2*hh;
+                B22 = B11 + 3*hh;
+            }
+            send_block(A11, ld, half, child1, 2);
+            send_block(B11, ld, half, child1, 2);
+            send_block(A12, ld, half, child2, 2);
+            send_block(B21, ld, half, child2, 2);
+            send_block(A11, ld, half, child3, 2);
+            send_block(B12, ld, half, child3, 2);
+            send_block(A12, ld, half, child4, 2);
+            send_block(B22, ld, half, child4, 2);
+            send_block(A21, ld, half, child5, 2);
+            send_block(B11, ld, half, child5, 2);
+            send_block(A22, ld, half, child6, 2);
+            send_block(B21, ld, half, child6, 2);
+            send_block(A21, ld, half, child7, 2);
+            send_block(B12, ld, half, child7, 2);
+            send_block(A22, ld, half, child8, 2);
+            send_block(B22, ld, half, child8, 2);
+        }
         
         
         
@@ -186,70 +381,84 @@ void main(int argc, char** argv) {
         
         
         
+    }
+    
+    if(!RMA_RESULT && curr_dim > delta) {
         //Time to receive
         
-        //8 matrix multiplications will be performed.
-        //Declare and allocate 8 matrices. Note that matrices
-        //names tell which multiplications they will store.
-        int *A11B11;
-        int *A12B21;
-        int *A11B12;
-        int *A12B22;
-        int *A21B11;
-        int *A22B21;
-        int *A21B12;
-        int *A22B22;
-        
-        matrix_alloc(&A11B11, half);
-        matrix_alloc(&A12B21, half);
-        matrix_alloc(&A11B12, half);
-        matrix_alloc(&A12B22, half);
-        matrix_alloc(&A21B11, half);
-        matrix_alloc(&A22B21, half);
-        matrix_alloc(&A21B12, half);
-        matrix_alloc(&A22B22, half);
-        
-        //Receive the results
-        MPI_Recv (A11B11, half*half, MPI_INT, child1, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-        printf("[%d] receives from child1[%d].\n", my_rank, child1);
-        MPI_Recv (A12B21, half*half, MPI_INT, child2, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-        printf("[%d] receives from child2[%d].\n", my_rank, child2);
-        MPI_Recv (A11B12, half*half, MPI_INT, child3, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-        printf("[%d] receives from child3[%d].\n", my_rank, child3);
-        MPI_Recv (A12B22, half*half, MPI_INT, child4, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-        printf("[%d] receives from child4[%d].\n", my_rank, child4);
-        MPI_Recv (A21B11, half*half, MPI_INT, child5, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-        printf("[%d] receives from child5[%d].\n", my_rank, child5);
-        MPI_Recv (A22B21, half*half, MPI_INT, child6, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-        printf("[%d] receives from child6[%d].\n", my_rank, child6);
-        MPI_Recv (A21B12, half*half, MPI_INT, child7, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-        printf("[%d] receives from child7[%d].\n", my_rank, child7);
-        MPI_Recv (A22B22, half*half, MPI_INT, child8, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-        printf("[%d] receives from child8[%d].\n", my_rank, child8);
-        
-        //Time to sum the multiplication results. Each sum will be stored in
-        //one quarter of the result matrix C.
-        msum(A11B11, A12B21, C,    0,    0, half); //C11
-        msum(A11B12, A12B22, C,    0, half, half); //C12
-        msum(A21B11, A22B21, C, half,    0, half); //C21
-        msum(A21B12, A22B22, C, half, half, half); //C22
-        
-        free(A11B11);
-        free(A12B21);
-        free(A11B12);
-        free(A12B22);
-        free(A21B11);
-        free(A22B21);
-        free(A21B12);
-        free(A22B22);
+        //8 matrix multiplications will be performed, two for each quadrant
+        //of C. Each product is reduced into its quadrant as soon as it is
+        //received, so products never pile up: the first product of a
+        //quadrant is received straight into it, the second one is added.
+        //With PAIR_REDUCTION the first child of every quadrant sends the
+        //sum of both, received straight into it.
+        collector col;
+        if(MORTON_LAYOUT) {
+            collect_init_morton(&col, C, half, NONBLOCKING_COLLECT);
+        } else {
+            collect_init(&col, C, curr_dim, half, NONBLOCKING_COLLECT);
+        }
+        if(PAIR_REDUCTION) {
+            collect_target(&col, collect_expect(&col, child1), 0, 1); //A11B11 + A12B21
+            collect_target(&col, collect_expect(&col, child3), 1, 1); //A11B12 + A12B22
+            collect_target(&col, collect_expect(&col, child5), 2, 1); //A21B11 + A22B21
+            collect_target(&col, collect_expect(&col, child7), 3, 1); //A21B12 + A22B22
+        } else {
+            collect_target(&col, collect_expect(&col, child1), 0, 1); //A11B11
+            collect_target(&col, collect_expect(&col, child2), 0, 1); //A12B21
+            collect_target(&col, collect_expect(&col, child3), 1, 1); //A11B12
+            collect_target(&col, collect_expect(&col, child4), 1, 1); //A12B22
+            collect_target(&col, collect_expect(&col, child5), 2, 1); //A21B11
+            collect_target(&col, collect_expect(&col, child6), 2, 1); //A22B21
+            collect_target(&col, collect_expect(&col, child7), 3, 1); //A21B12
+            collect_target(&col, collect_expect(&col, child8), 3, 1); //A22B22
+        }
+        //Panels of our C go on as soon as they are done, unless the result
+        //of our sibling is still to be added.
+        if(dest >= 0 && sibling < 0) {
+            collect_forward(&col, dest);
+        }
+        collect_start(&col);
+        collect_finish(&col);
     }
 
-    // Send back to father
+    // Send back to father. Dividing processes already streamed their C
+    // while collecting it.
+    if(RMA_RESULT) {
+        //Leaves add their product to its place in the result of the root.
+        if (curr_dim <= delta) {
+            if(MORTON_LAYOUT) {
+                result_accumulate(C, curr_dim, curr_dim,
+                                  morton_offset(ol + al, oc + bc, curr_dim, matrix_dim),
+                                  curr_dim, win_c);
+            } else {
+                result_accumulate(C, curr_dim, curr_dim,
+                                  (MPI_Aint)(ol + al)*matrix_dim + oc + bc,
+                                  matrix_dim, win_c);
+            }
+        }
+        result_window_close(&win_c);
+        if(my_rank == 0) {
+            free(C);
+            C = C_all;
+        }
+    }
     if ( my_rank !=0 ) { //not root
-        MPI_Send(C, curr_dim*curr_dim, MPI_INT, father, 1, MPI_COMM_WORLD);
+        if(sibling >= 0) {
+            pair_reduce(C, curr_dim, sibling, father);
+        } else if (!RMA_RESULT && curr_dim <= delta) {
+            send_result(C, curr_dim, curr_dim, dest);
+        }
         
     
     } else { //root
+        if(MORTON_LAYOUT) {
+            elem *R;
+            matrix_alloc(&R, curr_dim);
+            from_morton(C, R, curr_dim, curr_dim);
+            free(C);
+            C = R;
+        }
         //printf("Root results:\n");
         //print_matrix(C, curr_dim);
         t2 = MPI_Wtime();
@@ -257,6 +466,12 @@ void main(int argc, char** argv) {
     }
     
     free(C);
-    printf("[%d] done\n", my_rank);
+    ws_free();
+    if(SHARED_INPUT && !DISTRIBUTED_INPUT) {
+        matrix_free_shared(&win_a);
+        matrix_free_shared(&win_b);
+    }
+    config_report("mpi_mmulti", t2-t1);
+    trace_write();
     MPI_Finalize();
 }
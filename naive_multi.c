@@ -6,28 +6,34 @@
 #include <time.h>
 #include "mmulti.h"
 
-#define MATRIX_DIM (1<<10)
+//Dimension of the matrices being multiplied, unless configured otherwise
+//(see config.c). Other shapes are padded to a square.
+#define DEFAULT_DIM (1<<10)
 
-void main() {
+void main(int argc, char **argv) {
+    if(config_init(argc, argv, DEFAULT_DIM, 0, 0) != 0) {
+        exit(1);
+    }
+    int matrix_dim = config_padded(1);
     printf("Program start.\n");
-    printf("Multiplication of 2 %dx%d matrices.\n", MATRIX_DIM, MATRIX_DIM);
-    int *A;
-    int *B;
-    int *C;
+    printf("Multiplication of %dx%d and %dx%d %s matrices.\n", cfg_m, cfg_k, cfg_k, cfg_n, ELEM_NAME);
+    elem *A;
+    elem *B;
+    elem *C;
     
     clock_t t;
     
-    matrix_alloc(&A, MATRIX_DIM);
-    matrix_alloc(&B, MATRIX_DIM);
-    matrix_alloc(&C, MATRIX_DIM);
+    matrix_alloc(&A, matrix_dim);
+    matrix_alloc(&B, matrix_dim);
+    matrix_alloc(&C, matrix_dim);
     
-    matrix_init(A, MATRIX_DIM, 0);
-    matrix_init(B, MATRIX_DIM, 2);
+    block_init(A, matrix_dim, matrix_dim, cfg_m, cfg_k, 0, 0, 0);
+    block_init(B, matrix_dim, matrix_dim, cfg_k, cfg_n, 0, 0, 2);
     
     printf("Multiplication start.\n");
     t = clock();
     
-    naive_multi(A, B, C, MATRIX_DIM);
+    naive_multi(A, B, C, matrix_dim);
     
     t = clock() - t;
     printf("Multiplication done.\n");
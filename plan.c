@@ -0,0 +1,410 @@
+/*
+Planned multiplications, for callers running the same shapes over and over.
+
+mm_plan_create() does once everything the divide and conquer tree of
+strat_c_mmulti needs for given shapes, and mm_execute() then only runs it,
+with no allocation and no setup:
+    mm_plan *p = mm_plan_create(m, k, n, ELEM_TYPE, MPI_COMM_WORLD, MM_THREADS);
+    for(...) {
+        mm_execute(p, A, B, C);         //A, B and C only matter on the root
+    }
+    mm_plan_destroy(p);
+
+The tree is the one of strat_c_mmulti, as deep as the processes of the
+communicator allow: with d divisions, 8^d processes take part, the others
+wait in mm_execute() for nothing. At every level, each process keeps the
+first of the 8 products of its block for itself and hands the 7 others to
+the processes joining the tree there, rank 8^l + 7*father + child - 1. The
+two children whose products go to the same quadrant add them together
+before sending the sum back (see pair_reduce()), so a process receives 3 of
+them straight into its C, and the last one, which goes to the quadrant it
+computes itself, into a buffer.
+
+The plan precomputes, for the process it is made on:
+    - its block and those of its children at every level;
+    - the datatypes of the blocks of A, B and C it sends and receives;
+    - the buffers of its blocks, of the products it adds and its requests;
+    - the workspace of the leaf kernel, on every thread it runs on.
+Blocks are halved as they are, the first half taking the odd line or
+colum, so the operands need no padding and every process only ever holds
+the blocks of A and B its subtree works on.
+
+Operands are row-major: A is m x k, B is k x n and C is m x n, every line
+right after the previous one. With MPI_COMM_NULL the plan is local to the
+calling process and makes no MPI call at all, so it can be used before
+MPI_Init() or without it.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mpi.h"
+#include "mmulti.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//Message tags.
+#define PLAN_TAG_A 1
+#define PLAN_TAG_B 2
+#define PLAN_TAG_C 3
+
+//Block of the product, in lines/colums of the whole matrices: the process
+//in charge of it computes C[l..l+rows, c..c+cols] += A[l.., i..] B[i.., c..]
+//over inner colums of A.
+typedef struct {
+    int l;
+    int i;
+    int c;
+    int rows;
+    int inner;
+    int cols;
+} plan_block;
+
+
+//First (second = 0) or second half of the len lines/colums at off.
+static void half(int off, int len, int second, int *h_off, int *h_len) {
+    int h = (len + 1)/2;
+    *h_off = second ? off + h : off;
+    *h_len = second ? len - h : h;
+}
+
+//Product s of block b, in the order of strat_c_mmulti: the first one is
+//kept by the process, the next three pairs each go to one quadrant of C
+//(C12, C21, C22) and the last one goes to C11.
+static void sub_block(const plan_block *b, int s, plan_block *sub) {
+    int q = (s == 0 || s == 7) ? 0 : (s+1)/2;
+    int x = (s == 7) || (s > 0 && s%2 == 0);
+    half(b->l, b->rows, q/2, &sub->l, &sub->rows);
+    half(b->i, b->inner, x, &sub->i, &sub->inner);
+    half(b->c, b->cols, q%2, &sub->c, &sub->cols);
+}
+
+//Level process r joins the tree at.
+static int join_level(int r) {
+    int level = 0, first = 1;
+    while(r >= first) {
+        first *= 8;
+        level++;
+    }
+    return level;
+}
+
+//Block process r gets when it joins the tree.
+static void own_block(mm_plan *p, int r, plan_block *b) {
+    int level, father, first, l;
+    plan_block fb;
+    if(r == 0) {
+        b->l = b->i = b->c = 0;
+        b->rows = p->m;
+        b->inner = p->k;
+        b->cols = p->n;
+        return;
+    }
+    level = join_level(r);
+    first = simple_pow(8, level-1);
+    father = (r - first)/7;
+    own_block(p, father, &fb);
+    //The father keeps the first product of every level it divides.
+    for(l=join_level(father); l<level-1; l++) {
+        sub_block(&fb, 0, &fb);
+    }
+    sub_block(&fb, (r - first)%7 + 1, b);
+}
+
+//rows x cols block of a matrix whose lines are ld elements apart.
+static MPI_Datatype block_type(int rows, int cols, int ld) {
+    MPI_Datatype t;
+    MPI_Type_vector(rows, cols, ld, MPI_ELEM, &t);
+    MPI_Type_commit(&t);
+    return t;
+}
+
+//Reserves the workspace of every thread the leaf of p runs on, so
+//mm_execute() finds the arenas sized already.
+static void plan_reserve(mm_plan *p) {
+#ifdef _OPENMP
+    if(p->threads > 1) {
+        #pragma omp parallel num_threads(p->threads)
+        ws_reserve(p->workspace);
+        return;
+    }
+#endif
+    ws_reserve(p->workspace);
+}
+
+/*
+Params:
+m, k, n = shapes of the operands: A is m x k, B is k x n.
+elem_type = ELEM_INT32, ELEM_INT64, ELEM_FLOAT or ELEM_DOUBLE, which must be
+            the one the library was built for (see ELEM_TYPE).
+comm = processes sharing the work, rank 0 holding the operands, or
+       MPI_COMM_NULL for a local plan.
+options = MM_THREADS and/or MM_STRASSEN.
+Returns the plan, or NULL if it can't be made. Collective over comm.
+*/
+mm_plan *mm_plan_create(int m, int k, int n, int elem_type, MPI_Comm comm,
+                        int options) {
+    mm_plan *p;
+    plan_block own, lb, cb;
+    int proc_n = 1, smallest, level, s;
+
+    if(elem_type != ELEM_TYPE) {
+        printf("This build multiplies %s matrices only.\n", ELEM_NAME);
+        return NULL;
+    }
+    if(m <= 0 || k <= 0 || n <= 0) {
+        printf("Invalid shapes %dx%dx%d.\n", m, k, n);
+        return NULL;
+    }
+    p = calloc(1, sizeof(mm_plan));
+    if(p == NULL) {
+        printf("malloc failed!\n");
+        exit(1);
+    }
+    p->m = m;
+    p->k = k;
+    p->n = n;
+    p->comm = MPI_COMM_NULL;
+    p->father = p->dest = p->sibling = -1;
+
+    if(comm != MPI_COMM_NULL) {
+        //Messages of the plan never mix with those of the caller.
+        MPI_Comm_dup(comm, &p->comm);
+        MPI_Comm_rank(p->comm, &p->my_rank);
+        MPI_Comm_size(p->comm, &proc_n);
+    }
+    //As deep as the processes allow, without halving a dimension to
+    //nothing.
+    smallest = (m < k) ? m : k;
+    smallest = (n < smallest) ? n : smallest;
+    while(p->divisions < PLAN_LEVELS-1 && simple_pow(8, p->divisions+1) <= proc_n
+          && (2 << p->divisions) <= smallest) {
+        p->divisions++;
+    }
+    if(p->my_rank >= simple_pow(8, p->divisions)) {
+        p->join = -1;
+        return p;
+    }
+
+    p->join = join_level(p->my_rank);
+    own_block(p, p->my_rank, &own);
+    p->rows = own.rows;
+    p->inner = own.inner;
+    p->cols = own.cols;
+    if(p->my_rank == 0) {
+        //The operands of the caller.
+        p->lda = k;
+        p->ldb = n;
+        p->ldc = n;
+    } else {
+        int first = simple_pow(8, p->join-1);
+        int child = (p->my_rank - first)%7 + 1;
+        p->father = (p->my_rank - first)/7;
+        p->lda = own.inner;
+        p->ldb = own.cols;
+        p->ldc = own.cols;
+        matrix_alloc_rect(&p->A, own.rows, own.inner);
+        matrix_alloc_rect(&p->B, own.inner, own.cols);
+        matrix_alloc_rect(&p->C, own.rows, own.cols);
+        //The first of a pair adds the product of the second.
+        p->dest = p->father;
+        if(child == 1 || child == 3 || child == 5) {
+            p->sibling = p->my_rank + 1;
+            matrix_alloc_rect(&p->S, own.rows, own.cols);
+        } else if(child != 7) {
+            p->dest = p->my_rank - 1;
+        }
+    }
+
+    //Children of every level the process divides at, its block at each
+    //level being the first product of the one above.
+    lb = own;
+    for(level=p->join; level<p->divisions; level++) {
+        int first = simple_pow(8, level);
+        for(s=1; s<8; s++) {
+            plan_child *c = &p->child[level][s-1];
+            sub_block(&lb, s, &cb);
+            c->rank = first + p->my_rank*7 + s-1;
+            c->rows = cb.rows;
+            c->cols = cb.cols;
+            c->a_off = (size_t)(cb.l - own.l)*p->lda + (cb.i - own.i);
+            c->b_off = (size_t)(cb.i - own.i)*p->ldb + (cb.c - own.c);
+            c->c_off = (size_t)(cb.l - own.l)*p->ldc + (cb.c - own.c);
+            c->a_type = block_type(cb.rows, cb.inner, p->lda);
+            c->b_type = block_type(cb.inner, cb.cols, p->ldb);
+            c->c_type = MPI_DATATYPE_NULL;
+            if(s == 1 || s == 3 || s == 5) {
+                c->c_type = block_type(cb.rows, cb.cols, p->ldc);
+            }
+        }
+        //The product of the last child goes to the quadrant of the process.
+        matrix_alloc_rect(&p->T[level], p->child[level][6].rows, p->child[level][6].cols);
+        sub_block(&lb, 0, &lb);
+    }
+    p->leaf_rows = lb.rows;
+    p->leaf_inner = lb.inner;
+    p->leaf_cols = lb.cols;
+
+    p->strassen = (options & MM_STRASSEN) && lb.rows == lb.inner && lb.inner == lb.cols;
+    p->threads = 1;
+#ifdef _OPENMP
+    if(options & MM_THREADS) {
+        p->threads = omp_get_max_threads();
+    }
+#endif
+    if(p->strassen) {
+        //The recursion is not split between threads.
+        p->threads = 1;
+        p->workspace = strassen_workspace(lb.rows);
+    } else {
+        //Every thread packs its own share of the lines.
+        p->workspace = tiled_workspace((lb.rows + p->threads - 1)/p->threads,
+                                       lb.cols, lb.inner);
+    }
+
+    //Picked before any thread runs so they never race on it.
+    kernel_current();
+    plan_reserve(p);
+    return p;
+}
+
+//Computes the product the process keeps for itself, into the top left
+//corner of its C.
+static void plan_leaf(mm_plan *p, const elem *A, const elem *B, elem *C) {
+    if(p->strassen) {
+        strassen_multi(A, p->lda, B, p->ldb, C, p->ldc, p->leaf_rows);
+        return;
+    }
+#ifdef _OPENMP
+    if(p->threads > 1) {
+        #pragma omp parallel num_threads(p->threads)
+        {
+            int t = omp_get_thread_num();
+            int first = (int)((long)p->leaf_rows*t/p->threads);
+            int last = (int)((long)p->leaf_rows*(t+1)/p->threads);
+            if(last > first) {
+                tiled_multi(A + (size_t)first*p->lda, p->lda, B, p->ldb,
+                            C + (size_t)first*p->ldc, p->ldc,
+                            last - first, p->leaf_cols, p->leaf_inner);
+            }
+        }
+        return;
+    }
+#endif
+    tiled_multi(A, p->lda, B, p->ldb, C, p->ldc,
+                p->leaf_rows, p->leaf_cols, p->leaf_inner);
+}
+
+//C[0..rows, 0..cols] += X, X being rows x cols.
+static void plan_add(elem *C, int ldc, const elem *X, int rows, int cols) {
+    int i;
+    double ts = trace_now();
+    for(i=0; i<rows; i++) {
+        row_sum(&C[(size_t)i*ldc], &X[(size_t)i*cols], &C[(size_t)i*ldc], cols);
+    }
+    trace_span(TRACE_MSUM, ts, -1, 0);
+}
+
+//Computes C = A*B as planned by p. A, B and C are only used on the root,
+//the others may pass NULL. Collective over the communicator of the plan.
+void mm_execute(mm_plan *p, const elem *A, const elem *B, elem *C) {
+    int level, s, sends = 0;
+    double ts;
+    if(p->join < 0) {
+        return;
+    }
+    if(p->my_rank != 0) {
+        A = p->A;
+        B = p->B;
+        C = p->C;
+        ts = trace_now();
+        MPI_Recv(p->A, p->rows*p->inner, MPI_ELEM, p->father, PLAN_TAG_A, p->comm,
+                 MPI_STATUS_IGNORE);
+        MPI_Recv(p->B, p->inner*p->cols, MPI_ELEM, p->father, PLAN_TAG_B, p->comm,
+                 MPI_STATUS_IGNORE);
+        trace_span(TRACE_RECV, ts, p->father,
+                   ((long)p->rows*p->inner + (long)p->inner*p->cols)*sizeof(elem));
+    }
+
+    //Operands go down the whole subtree before the process starts on its
+    //own product, and the products of the children may arrive meanwhile.
+    for(level=p->join; level<p->divisions; level++) {
+        plan_child *c = p->child[level];
+        ts = trace_now();
+        for(s=0; s<7; s++) {
+            MPI_Isend((elem *)A + c[s].a_off, 1, c[s].a_type, c[s].rank, PLAN_TAG_A,
+                      p->comm, &p->send_req[sends++]);
+            MPI_Isend((elem *)B + c[s].b_off, 1, c[s].b_type, c[s].rank, PLAN_TAG_B,
+                      p->comm, &p->send_req[sends++]);
+        }
+        trace_span(TRACE_SEND, ts, -1, 0);
+        for(s=0; s<3; s++) {
+            MPI_Irecv(C + c[2*s].c_off, 1, c[2*s].c_type, c[2*s].rank, PLAN_TAG_C,
+                      p->comm, &p->recv_req[level][s]);
+        }
+        MPI_Irecv(p->T[level], c[6].rows*c[6].cols, MPI_ELEM, c[6].rank, PLAN_TAG_C,
+                  p->comm, &p->recv_req[level][3]);
+    }
+    if(p->sibling >= 0) {
+        MPI_Irecv(p->S, p->rows*p->cols, MPI_ELEM, p->sibling, PLAN_TAG_C, p->comm,
+                  &p->sibling_req);
+    }
+
+    ts = trace_now();
+    plan_leaf(p, A, B, C);
+    trace_span(TRACE_LEAF, ts, -1, 0);
+
+    //Deepest level first: the quadrant a level adds to holds the whole
+    //product of the level below once that one is done.
+    for(level=p->divisions-1; level>=p->join; level--) {
+        plan_child *c = p->child[level];
+        ts = trace_now();
+        MPI_Waitall(4, p->recv_req[level], MPI_STATUSES_IGNORE);
+        trace_span(TRACE_WAIT, ts, -1, 0);
+        plan_add(C, p->ldc, p->T[level], c[6].rows, c[6].cols);
+    }
+    if(p->sibling >= 0) {
+        ts = trace_now();
+        MPI_Wait(&p->sibling_req, MPI_STATUS_IGNORE);
+        trace_span(TRACE_WAIT, ts, p->sibling, 0);
+        plan_add(C, p->ldc, p->S, p->rows, p->cols);
+    }
+    if(p->my_rank != 0) {
+        ts = trace_now();
+        MPI_Send(C, p->rows*p->cols, MPI_ELEM, p->dest, PLAN_TAG_C, p->comm);
+        trace_span(TRACE_SEND, ts, p->dest, (long)p->rows*p->cols*sizeof(elem));
+    }
+    if(sends > 0) {
+        MPI_Waitall(sends, p->send_req, MPI_STATUSES_IGNORE);
+    }
+}
+
+//Frees everything the plan holds. The workspace arenas are kept for the
+//next plans, ws_free() gives them back. Collective over the communicator
+//of the plan.
+void mm_plan_destroy(mm_plan *p) {
+    int level, s;
+    if(p == NULL) {
+        return;
+    }
+    for(level=p->join; p->join >= 0 && level<p->divisions; level++) {
+        for(s=0; s<7; s++) {
+            MPI_Type_free(&p->child[level][s].a_type);
+            MPI_Type_free(&p->child[level][s].b_type);
+            if(p->child[level][s].c_type != MPI_DATATYPE_NULL) {
+                MPI_Type_free(&p->child[level][s].c_type);
+            }
+        }
+        free(p->T[level]);
+    }
+    if(p->comm != MPI_COMM_NULL) {
+        MPI_Comm_free(&p->comm);
+    }
+    free(p->S);
+    free(p->A);
+    free(p->B);
+    free(p->C);
+    free(p);
+}
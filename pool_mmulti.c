@@ -0,0 +1,339 @@
+//Example use:
+//ladrun -np 64 pool_mmulti -s 5000x3000x4000
+//ladrun -np 64 pool_mmulti -a a.mat -b b.mat -o c.mat
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mpi.h"
+#include "mmulti.h"
+
+/*
+Master/worker scheduling of the multiplication over any number of processes.
+
+Instead of a computation tree needing a full set of processes, C is split
+into a pool of TASK_DIM x TASK_DIM blocks. Computing one block takes a line
+panel of A and a colum panel of B, so tasks are independent and a process
+that finishes early simply asks for more work.
+
+The root only schedules: it keeps TASKS_IN_FLIGHT tasks queued on every
+worker, so a worker always has its next task at hand when it sends a block
+back, and hands out a new task each time a block arrives. Blocks are
+received straight into their place in C. Tasks are handed out line by line,
+so consecutive tasks of a worker tend to share their panel of A.
+
+With a single process the root computes every task itself.
+
+The shape of the matrices is read at runtime (see config.c). Any M x K times
+K x N product is handled without padding: tasks on the last line and colum
+of the pool are simply smaller.
+
+Given matrix files for A and B (-a, -b), the multiplication runs out of
+core: every process maps the files and a task streams its tiles of A and B
+from disk, tasks being the tiles of the files. Workers write every block
+they compute straight to the file of C (-o) through MPI-IO and only notify
+the root, so neither the operands nor the result ever need to fit in memory
+nor go through the root (see matfile.c).
+*/
+
+//Dimension of the matrices being multiplied, unless configured otherwise.
+#define DEFAULT_DIM (1<<13)
+
+//Lines/colums of the block of C computed by one task. Should leave many
+//more tasks than processes, so that the load evens out.
+#define TASK_DIM 512
+
+//Tasks queued on each worker.
+#define TASKS_IN_FLIGHT 2
+
+//Message tags.
+#define TAG_TASK 1
+#define TAG_RESULT 2
+#define TAG_STOP 3
+
+
+//A is cfg_m x cfg_k, B is cfg_k x cfg_n and C is cfg_m x cfg_n.
+elem *A;
+elem *B;
+
+//Operands and result when running out of core.
+int out_of_core = 0;
+matrix_file fa;
+matrix_file fb;
+matrix_file fc;
+
+//Lines/colums of the block of C computed by one task.
+int task_dim = TASK_DIM;
+
+//Blocks of C on a line of tasks.
+int tasks_per_line;
+
+
+//Position and size of the block of C of task t.
+void task_shape(int t, int *tl, int *tc, int *rows, int *cols) {
+    *tl = (t/tasks_per_line)*task_dim;
+    *tc = (t%tasks_per_line)*task_dim;
+    *rows = (cfg_m - *tl < task_dim) ? cfg_m - *tl : task_dim;
+    *cols = (cfg_n - *tc < task_dim) ? cfg_n - *tc : task_dim;
+}
+
+//Computes the block of C of task t into Ct, whose lines are ldc elements
+//apart.
+void compute_task(int t, elem *Ct, int ldc) {
+    int tl, tc, rows, cols;
+    double ts = trace_now();
+    task_shape(t, &tl, &tc, &rows, &cols);
+    if(out_of_core) {
+        mfile_tile_product(&fa, &fb, tl/task_dim, tc/task_dim, Ct, ldc, rows, cols);
+    } else {
+        tiled_multi(&A[(size_t)tl*cfg_k], cfg_k, &B[tc], cfg_n,
+                    Ct, ldc, rows, cols, cfg_k);
+    }
+    trace_span(TRACE_LEAF, ts, -1, 0);
+}
+
+//Opens the matrix files given on the command line and takes the shape of
+//the multiplication from them, then creates the file of C. Workers write
+//their blocks of C to it themselves through MPI-IO, a root working alone
+//maps it. Returns 0, or -1 if they can't be used.
+int open_files(int my_rank, int proc_n) {
+    if(cfg_a_file == NULL || cfg_b_file == NULL) {
+        if(my_rank == 0) {
+            printf("Both -a and -b are needed to read the operands from files.\n");
+        }
+        return -1;
+    }
+    if(mfile_open(&fa, cfg_a_file, 0) != 0 || mfile_open(&fb, cfg_b_file, 0) != 0) {
+        return -1;
+    }
+    if(fa.cols != fb.rows || fa.tile != fb.tile) {
+        if(my_rank == 0) {
+            printf("%s and %s can't be multiplied: %dx%d times %dx%d, tiles of %d and %d.\n",
+                   cfg_a_file, cfg_b_file, fa.rows, fa.cols, fb.rows, fb.cols,
+                   fa.tile, fb.tile);
+        }
+        return -1;
+    }
+    cfg_m = fa.rows;
+    cfg_k = fa.cols;
+    cfg_n = fb.cols;
+    task_dim = fa.tile;
+    out_of_core = 1;
+    if(cfg_c_file == NULL) {
+        if(my_rank == 0) {
+            printf("-o is needed to write the result to a file.\n");
+        }
+        return -1;
+    }
+    if(proc_n == 1) {
+        return mfile_create(&fc, cfg_c_file, cfg_m, cfg_n, task_dim);
+    }
+    return mfile_pcreate(&fc, cfg_c_file, cfg_m, cfg_n, task_dim, MPI_COMM_WORLD);
+}
+
+//Top left element of the block of C of task t.
+elem *task_block(elem *C, int t) {
+    int tl, tc, rows, cols;
+    task_shape(t, &tl, &tc, &rows, &cols);
+    return &C[(size_t)tl*cfg_n + tc];
+}
+
+
+int main(int argc, char** argv) {
+
+    //C points to the resulting matrix on the root, to the block of the
+    //current task on workers.
+    elem *C;
+
+    int n_tasks;
+
+    //Next task to hand out.
+    int next = 0;
+
+    //Tasks sent to each worker and not answered yet, in the order they
+    //were sent: worker w has queued[w] tasks starting at
+    //pending[w*TASKS_IN_FLIGHT + head[w]].
+    int *pending;
+    int *head;
+    int *queued;
+    int outstanding = 0;
+
+    int t, w, f;
+    int tl, tc, rows, cols;
+
+    //For execution time measuring.
+    double t1 = 0, t2 = 0, ts;
+
+    int my_rank; //Process id.
+    int proc_n; //Total number of processes
+    MPI_Status status;
+    MPI_Init(&argc , &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &proc_n);
+
+    if(config_init(argc, argv, DEFAULT_DIM, 0, my_rank != 0) != 0) {
+        exit(1);
+    }
+    if(cfg_a_file != NULL || cfg_b_file != NULL) {
+        if(open_files(my_rank, proc_n) != 0) {
+            exit(1);
+        }
+    } else {
+        matrix_alloc_rect(&A, cfg_m, cfg_k);
+        matrix_alloc_rect(&B, cfg_k, cfg_n);
+        block_init(A, cfg_m, cfg_k, cfg_m, cfg_k, 0, 0, 0);
+        block_init(B, cfg_k, cfg_n, cfg_k, cfg_n, 0, 0, 2);
+    }
+    trace_init();
+    tasks_per_line = (cfg_n + task_dim-1)/task_dim;
+    n_tasks = tasks_per_line*((cfg_m + task_dim-1)/task_dim);
+
+
+    if(my_rank != 0) { //worker
+
+        matrix_alloc(&C, task_dim);
+        if(out_of_core) {
+            ws_reserve(mfile_workspace(&fa));
+        } else {
+            ws_reserve(tiled_workspace(task_dim, task_dim, cfg_k));
+        }
+        while(1) {
+            ts = trace_now();
+            MPI_Recv(&t, 1, MPI_INT, 0, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+            trace_span(TRACE_RECV, ts, 0, sizeof(int));
+            if(status.MPI_TAG == TAG_STOP) {
+                break;
+            }
+            task_shape(t, &tl, &tc, &rows, &cols);
+            if(out_of_core) {
+                //The whole tile goes to the file, padding included.
+                memset(C, 0, (size_t)task_dim*task_dim*sizeof(elem));
+                compute_task(t, C, task_dim);
+                ts = trace_now();
+                mfile_write_tile(&fc, C, tl/task_dim, tc/task_dim);
+                trace_span(TRACE_IO, ts, -1, (long)task_dim*task_dim*sizeof(elem));
+                MPI_Send(C, 0, MPI_ELEM, 0, TAG_RESULT, MPI_COMM_WORLD);
+                continue;
+            }
+            compute_task(t, C, cols);
+            ts = trace_now();
+            MPI_Send(C, rows*cols, MPI_ELEM, 0, TAG_RESULT, MPI_COMM_WORLD);
+            trace_span(TRACE_SEND, ts, 0, (long)rows*cols*sizeof(elem));
+        }
+
+    } else if(proc_n == 1) { //root working alone
+
+        printf("Dimensions of the %s matrices: %dx%d times %dx%d\n",
+               ELEM_NAME, cfg_m, cfg_k, cfg_k, cfg_n);
+        printf("Computing %d tasks alone.\n", n_tasks);
+        if(out_of_core) {
+            t1 = MPI_Wtime();
+            ooc_multi(&fa, &fb, &fc);
+        } else {
+            matrix_alloc_rect(&C, cfg_m, cfg_n);
+            ws_reserve(tiled_workspace(task_dim, task_dim, cfg_k));
+            t1 = MPI_Wtime();
+            for(t=0; t<n_tasks; t++) {
+                compute_task(t, task_block(C, t), cfg_n);
+            }
+        }
+
+    } else { //root scheduling the workers
+
+        printf("Dimensions of the %s matrices: %dx%d times %dx%d\n",
+               ELEM_NAME, cfg_m, cfg_k, cfg_k, cfg_n);
+        printf("Scheduling %d tasks on %d workers.\n", n_tasks, proc_n-1);
+        if(!out_of_core) {
+            matrix_alloc_rect(&C, cfg_m, cfg_n);
+        }
+        pending = malloc(proc_n*TASKS_IN_FLIGHT*sizeof(int));
+        head = calloc(proc_n, sizeof(int));
+        queued = calloc(proc_n, sizeof(int));
+        if(pending == NULL || head == NULL || queued == NULL) {
+            printf("malloc failed!\n");
+            exit(1);
+        }
+        t1 = MPI_Wtime();
+
+        //Fill the queue of every worker. Those left without a task are
+        //stopped right away.
+        for(f=0; f<TASKS_IN_FLIGHT; f++) {
+            for(w=1; w<proc_n && next<n_tasks; w++) {
+                pending[w*TASKS_IN_FLIGHT + f] = next;
+                MPI_Send(&next, 1, MPI_INT, w, TAG_TASK, MPI_COMM_WORLD);
+                queued[w]++;
+                outstanding++;
+                next++;
+            }
+        }
+        for(w=1; w<proc_n; w++) {
+            if(queued[w] == 0) {
+                MPI_Send(&next, 1, MPI_INT, w, TAG_STOP, MPI_COMM_WORLD);
+            }
+        }
+
+        //Blocks come back from each worker in the order its tasks were
+        //sent, so the source of a block tells which task it belongs to.
+        while(outstanding > 0) {
+            ts = trace_now();
+            MPI_Probe(MPI_ANY_SOURCE, TAG_RESULT, MPI_COMM_WORLD, &status);
+            trace_span(TRACE_WAIT, ts, status.MPI_SOURCE, 0);
+            w = status.MPI_SOURCE;
+            t = pending[w*TASKS_IN_FLIGHT + head[w]];
+            head[w] = (head[w]+1)%TASKS_IN_FLIGHT;
+            queued[w]--;
+            outstanding--;
+            task_shape(t, &tl, &tc, &rows, &cols);
+            if(out_of_core) {
+                //Just the notice, the block is already in the file.
+                MPI_Recv(NULL, 0, MPI_ELEM, w, TAG_RESULT, MPI_COMM_WORLD, &status);
+            } else {
+                recv_rect(task_block(C, t), cfg_n, rows, cols, w, TAG_RESULT);
+            }
+
+            if(next < n_tasks) {
+                pending[w*TASKS_IN_FLIGHT + (head[w]+queued[w])%TASKS_IN_FLIGHT] = next;
+                MPI_Send(&next, 1, MPI_INT, w, TAG_TASK, MPI_COMM_WORLD);
+                queued[w]++;
+                outstanding++;
+                next++;
+            } else if(queued[w] == 0) {
+                MPI_Send(&next, 1, MPI_INT, w, TAG_STOP, MPI_COMM_WORLD);
+            }
+        }
+
+        free(pending);
+        free(head);
+        free(queued);
+    }
+
+
+    if(my_rank == 0) {
+        t2 = MPI_Wtime();
+        //print_matrix(C, cfg_n);
+        printf("Time taken: %.2f\n", t2-t1);
+    }
+
+    if(out_of_core) {
+        mfile_close(&fa);
+        mfile_close(&fb);
+        if(proc_n == 1) {
+            mfile_close(&fc);
+        } else {
+            mfile_pclose(&fc);
+        }
+    } else {
+        free(A);
+        free(B);
+    }
+    if(my_rank != 0 || !out_of_core) {
+        free(C);
+    }
+    ws_free();
+
+
+    config_report("pool_mmulti", t2-t1);
+    trace_write();
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,563 @@
+//Example use:
+//ladrun -np 65 serve_mmulti -q /scratch/spool
+//printf "a a.mat\nb b.mat\nc c.mat\n" > /scratch/spool/j1.tmp
+//mv /scratch/spool/j1.tmp /scratch/spool/j1.job
+//touch /scratch/spool/stop
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <limits.h>
+#include "mpi.h"
+#include "mmulti.h"
+
+/*
+Multiplication service: the processes start once and serve a stream of jobs,
+so short multiplications no longer pay for MPI_Init, the allocations and the
+teardown of a whole run each.
+
+Jobs are dropped in a spool directory (-q, see config.c) as NAME.job files of
+"key path" lines naming the matrix files (see matfile.c) of the operands and
+of the result:
+    a a.mat
+    b b.mat
+    c c.mat
+Relative paths are taken from the spool directory. Write the job under
+another name and rename it to NAME.job once complete, the root may pick it
+up at any time. The root claims a job by renaming it to NAME.run, creates
+the file of C, and renames the job to NAME.done once every tile of C is
+written, or to NAME.failed if it can't be run, on any process. A failed job
+never stops the service. A file named "stop" in the
+spool directory makes the service finish the jobs it has started and exit.
+
+Scheduling is the one of pool_mmulti, over the jobs of the spool instead of
+a single multiplication: tasks are the tiles of C, computed by the workers
+straight from the mapped files of A and B, and written to the file of C
+through MPI-IO as pool_mmulti does, since tiles sharing a page of a mapping
+could be written by processes on different nodes. Up to
+SERVE_JOBS jobs are worked on at once, and tasks are handed out from the
+oldest job first: when it has fewer tasks left than the workers have room
+for, those of the next jobs fill the gap, so small jobs are batched together
+on the workers instead of running one after the other.
+
+Workers keep what they can from one job to the next: their workspace arena
+only grows when a job has larger tiles, and the files of every job being
+served stay open until its slot is taken by a new job.
+
+With a single process the root computes every task itself.
+*/
+
+//Jobs worked on at once.
+#define SERVE_JOBS 16
+
+//Tasks queued on each worker.
+#define TASKS_IN_FLIGHT 2
+
+//Microseconds between two scans of the spool directory while idle.
+#define SERVE_POLL 100000
+
+//Longest path of a file of a job.
+#define SERVE_PATH 1024
+
+//Message tags.
+#define TAG_TASK 1
+#define TAG_RESULT 2
+#define TAG_STOP 3
+#define TAG_JOB 4
+
+
+//Files of a job, as sent to the workers before its first task.
+typedef struct {
+    int serial;                         //Number of the job, from 1
+    int slot;                           //Place of the job in jobs[]
+    char path[3][SERVE_PATH];           //A, B and C
+} job_files;
+
+//Tile of C computed by a task.
+typedef struct {
+    int serial;
+    int slot;
+    int ti;
+    int tj;
+} job_task;
+
+//Job being served, on the root.
+typedef struct {
+    job_files files;
+    char name[SERVE_PATH];              //Job file, without its extension
+    int m, k, n;
+    int tile;
+    int tiles_per_line;
+    int n_tasks;
+    int next;                           //Next task to hand out
+    int done;                           //Tasks computed
+    int failed;                         //Files missing on some process
+    double start;
+} job;
+
+//Files of the job of a slot, on the process computing its tasks.
+typedef struct {
+    int serial;                         //0 if none
+    matrix_file a;                      //Mapped
+    matrix_file b;
+    matrix_file c;                      //Opened for MPI-IO
+} open_job;
+
+job jobs[SERVE_JOBS];
+open_job mapped[SERVE_JOBS];
+
+//Slots of the jobs being served, oldest first.
+int order[SERVE_JOBS];
+int n_active = 0;
+
+int last_serial = 0;
+int served = 0;
+
+
+//Closes the files of the job held in slot o, if any.
+void close_slot(open_job *o) {
+    if(o->serial != 0) {
+        mfile_close(&o->a);
+        mfile_close(&o->b);
+        mfile_pclose(&o->c);
+        o->serial = 0;
+    }
+}
+
+//Opens the files of a job in its slot, closing those of the job held there
+//before. Returns 0, or -1 if one of them can't be opened, the slot being
+//left empty.
+int open_slot(job_files *f) {
+    open_job *o = &mapped[f->slot];
+    close_slot(o);
+    if(mfile_open(&o->a, f->path[0], 0) != 0) {
+        return -1;
+    }
+    if(mfile_open(&o->b, f->path[1], 0) != 0) {
+        mfile_close(&o->a);
+        return -1;
+    }
+    if(mfile_popen(&o->c, f->path[2], 1, MPI_COMM_SELF) != 0) {
+        mfile_close(&o->a);
+        mfile_close(&o->b);
+        return -1;
+    }
+    o->serial = f->serial;
+    return 0;
+}
+
+//Computes the tile of C of task t and writes it to its file.
+void run_task(job_task *t) {
+    open_job *o = &mapped[t->slot];
+    int tile = o->c.tile;
+    int rows = (o->c.rows - t->ti*tile < tile) ? o->c.rows - t->ti*tile : tile;
+    int cols = (o->c.cols - t->tj*tile < tile) ? o->c.cols - t->tj*tile : tile;
+    size_t mark;
+    elem *C;
+    double ts;
+    //Grows only when a job comes with larger tiles.
+    ws_reserve(mfile_workspace(&o->a) + ws_round((size_t)tile*tile));
+    mark = ws_mark();
+    C = ws_alloc((size_t)tile*tile);
+    //The whole tile goes to the file, padding included.
+    memset(C, 0, (size_t)tile*tile*sizeof(elem));
+    ts = trace_now();
+    mfile_tile_product(&o->a, &o->b, t->ti, t->tj, C, tile, rows, cols);
+    trace_span(TRACE_LEAF, ts, -1, 0);
+    ts = trace_now();
+    mfile_write_tile(&o->c, C, t->ti, t->tj);
+    //In the file before the root hears of it and may report the job done.
+    MPI_File_sync(o->c.fh);
+    trace_span(TRACE_IO, ts, -1, (long)tile*tile*sizeof(elem));
+    ws_release(mark);
+}
+
+
+//====================================================================
+//Spool directory, on the root
+
+//Path of name in the spool directory, unless it is absolute. Returns 0, or
+//-1 if it is longer than SERVE_PATH.
+int spool_path(char *path, const char *name) {
+    int len;
+    if(name[0] == '/') {
+        len = snprintf(path, SERVE_PATH, "%s", name);
+    } else {
+        len = snprintf(path, SERVE_PATH, "%s/%s", cfg_spool_dir, name);
+    }
+    return (len < SERVE_PATH) ? 0 : -1;
+}
+
+//Renames the job file of j from NAME.from to NAME.to. Returns 0, or -1 if
+//it is gone, taken by another service for instance.
+int move_job(job *j, const char *from, const char *to) {
+    char old_path[SERVE_PATH+8], new_path[SERVE_PATH+8];
+    snprintf(old_path, sizeof(old_path), "%s.%s", j->name, from);
+    snprintf(new_path, sizeof(new_path), "%s.%s", j->name, to);
+    return rename(old_path, new_path);
+}
+
+//Reads the files of job j from its job file. Returns 0, or -1 if one is
+//missing.
+int read_job(job *j) {
+    char path[SERVE_PATH+8], line[SERVE_PATH+8], name[SERVE_PATH];
+    char key;
+    int found[3] = {0, 0, 0};
+    int i;
+    FILE *f;
+    snprintf(path, sizeof(path), "%s.run", j->name);
+    f = fopen(path, "r");
+    if(f == NULL) {
+        return -1;
+    }
+    while(fgets(line, sizeof(line), f) != NULL) {
+        if(sscanf(line, " %c %1023s", &key, name) != 2 || key == '#') {
+            continue;
+        }
+        i = (key == 'a') ? 0 : (key == 'b') ? 1 : (key == 'c') ? 2 : -1;
+        if(i >= 0) {
+            if(spool_path(j->files.path[i], name) != 0) {
+                printf("%s.run: path too long: %s\n", j->name, name);
+                fclose(f);
+                return -1;
+            }
+            found[i] = 1;
+        }
+    }
+    fclose(f);
+    if(!(found[0] && found[1] && found[2])) {
+        printf("%s.run: a, b and c are needed.\n", j->name);
+        return -1;
+    }
+    return 0;
+}
+
+//Claims the job file NAME.job, checks its operands and creates the file of
+//its result. Returns 0, or -1 if it can't be served.
+int admit(job *j, const char *file) {
+    matrix_file fa, fb, fc;
+    char name[SERVE_PATH];
+    snprintf(name, sizeof(name), "%.*s", (int)(strlen(file) - 4), file);
+    //Can't fail: the length of the spool directory is checked at startup.
+    if(spool_path(j->name, name) != 0 || move_job(j, "job", "run") != 0) {
+        return -1;
+    }
+    j->start = MPI_Wtime();
+    if(read_job(j) != 0) {
+        move_job(j, "run", "failed");
+        return -1;
+    }
+    if(mfile_open(&fa, j->files.path[0], 0) != 0) {
+        move_job(j, "run", "failed");
+        return -1;
+    }
+    if(mfile_open(&fb, j->files.path[1], 0) != 0) {
+        mfile_close(&fa);
+        move_job(j, "run", "failed");
+        return -1;
+    }
+    j->m = fa.rows;
+    j->k = fa.cols;
+    j->n = fb.cols;
+    j->tile = fa.tile;
+    mfile_close(&fa);
+    mfile_close(&fb);
+    if(fb.rows != j->k || fb.tile != j->tile) {
+        printf("%s: %dx%d times %dx%d, tiles of %d and %d can't be multiplied.\n",
+               name, j->m, j->k, fb.rows, j->n, j->tile, fb.tile);
+        move_job(j, "run", "failed");
+        return -1;
+    }
+    if(mfile_pcreate(&fc, j->files.path[2], j->m, j->n, j->tile, MPI_COMM_SELF) != 0) {
+        move_job(j, "run", "failed");
+        return -1;
+    }
+    mfile_pclose(&fc);
+    j->tiles_per_line = (j->n + j->tile-1)/j->tile;
+    j->n_tasks = j->tiles_per_line*((j->m + j->tile-1)/j->tile);
+    j->next = 0;
+    j->done = 0;
+    j->failed = 0;
+    j->files.serial = ++last_serial;
+    printf("[serve] %s: %s %dx%d times %dx%d, %d tasks.\n", j->name, ELEM_NAME,
+           j->m, j->k, j->k, j->n, j->n_tasks);
+    return 0;
+}
+
+//Admits the jobs waiting in the spool directory, in the order of their
+//names, while there are free slots. Returns 1 once the service is asked to
+//stop, without admitting anything more.
+int scan_spool() {
+    struct dirent **entries;
+    char path[SERVE_PATH];
+    int n, i, s, len;
+    int stop = 0;
+    n = scandir(cfg_spool_dir, &entries, NULL, alphasort);
+    if(n < 0) {
+        printf("Can't read the spool directory %s.\n", cfg_spool_dir);
+        exit(1);
+    }
+    //Looked for first, jobs sorting before it must not be started either.
+    for(i=0; i<n; i++) {
+        if(strcmp(entries[i]->d_name, "stop") == 0) {
+            if(spool_path(path, entries[i]->d_name) == 0) {
+                unlink(path);
+            }
+            stop = 1;
+        }
+    }
+    for(i=0; i<n; i++) {
+        char *file = entries[i]->d_name;
+        len = strlen(file);
+        if(!stop && n_active < SERVE_JOBS && len > 4
+           && strcmp(file + len - 4, ".job") == 0) {
+            //First free slot.
+            for(s=0; s<SERVE_JOBS; s++) {
+                int used = 0, a;
+                for(a=0; a<n_active; a++) {
+                    used |= (order[a] == s);
+                }
+                if(!used) {
+                    break;
+                }
+            }
+            jobs[s].files.slot = s;
+            if(admit(&jobs[s], file) == 0) {
+                order[n_active++] = s;
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return stop;
+}
+
+//Next task of the oldest job with tasks left. Returns its slot, or -1 if
+//every task is handed out.
+int next_task(job_task *t) {
+    int a;
+    for(a=0; a<n_active; a++) {
+        job *j = &jobs[order[a]];
+        if(j->next < j->n_tasks) {
+            t->serial = j->files.serial;
+            t->slot = order[a];
+            t->ti = j->next/j->tiles_per_line;
+            t->tj = j->next%j->tiles_per_line;
+            j->next++;
+            return order[a];
+        }
+    }
+    return -1;
+}
+
+//A task of the job in slot s is back, failed if the process it ran on
+//couldn't open the files of the job: its tasks not handed out yet are then
+//dropped. Once they are all back, the job is reported and its slot freed.
+void task_done(int s, int failed) {
+    job *j = &jobs[s];
+    int a;
+    if(failed && !j->failed) {
+        j->failed = 1;
+        j->done += j->n_tasks - j->next;
+        j->next = j->n_tasks;
+    }
+    if(++j->done < j->n_tasks) {
+        return;
+    }
+    if(j->failed) {
+        move_job(j, "run", "failed");
+        printf("[serve] %s failed: its files can't be opened on every process.\n",
+               j->name);
+    } else {
+        move_job(j, "run", "done");
+        printf("[serve] %s done in %.3f s.\n", j->name, MPI_Wtime() - j->start);
+        served++;
+    }
+    fflush(stdout);
+    for(a=0; order[a]!=s; a++);
+    for(; a<n_active-1; a++) {
+        order[a] = order[a+1];
+    }
+    n_active--;
+}
+
+
+int main(int argc, char** argv) {
+
+    //Tasks sent to each worker and not answered yet, as the slot of their
+    //job, in the order they were sent: worker w has queued[w] tasks
+    //starting at pending[w*TASKS_IN_FLIGHT + head[w]].
+    int *pending;
+    int *head;
+    int *queued;
+    int outstanding = 0;
+
+    //Job of every slot whose files each worker has mapped.
+    int *known;
+
+    job_task t;
+    job_files files;
+    int stopping = 0;
+    int failed;
+    int w, f, s;
+
+    //For execution time measuring.
+    double t1, t2, ts;
+
+    int my_rank; //Process id.
+    int proc_n; //Total number of processes
+    MPI_Status status;
+    MPI_Init(&argc , &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &proc_n);
+
+    if(config_init(argc, argv, 0, 0, my_rank != 0) != 0) {
+        exit(1);
+    }
+    if(cfg_spool_dir == NULL) {
+        if(my_rank == 0) {
+            printf("Usage: %s -q SPOOL_DIRECTORY\n", argv[0]);
+        }
+        exit(1);
+    }
+    //Room for the name of any job file after it.
+    if(strlen(cfg_spool_dir) + NAME_MAX + 2 > SERVE_PATH) {
+        if(my_rank == 0) {
+            printf("The path of the spool directory is too long.\n");
+        }
+        exit(1);
+    }
+    trace_init();
+    memset(mapped, 0, sizeof(mapped));
+
+    t1 = MPI_Wtime();
+
+    if(my_rank != 0) { //worker
+
+        while(1) {
+            ts = trace_now();
+            MPI_Probe(0, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+            trace_span(TRACE_WAIT, ts, 0, 0);
+            if(status.MPI_TAG == TAG_STOP) {
+                MPI_Recv(NULL, 0, MPI_INT, 0, TAG_STOP, MPI_COMM_WORLD, &status);
+                break;
+            }
+            if(status.MPI_TAG == TAG_JOB) {
+                MPI_Recv(&files, sizeof(files), MPI_BYTE, 0, TAG_JOB, MPI_COMM_WORLD, &status);
+                //Its tasks report the failure, the root marks the job failed.
+                open_slot(&files);
+                continue;
+            }
+            MPI_Recv(&t, sizeof(t), MPI_BYTE, 0, TAG_TASK, MPI_COMM_WORLD, &status);
+            failed = (mapped[t.slot].serial != t.serial);
+            if(!failed) {
+                run_task(&t);
+            }
+            MPI_Send(&failed, 1, MPI_INT, 0, TAG_RESULT, MPI_COMM_WORLD);
+        }
+
+    } else if(proc_n == 1) { //root working alone
+
+        printf("Serving %s alone.\n", cfg_spool_dir);
+        fflush(stdout);
+        while(1) {
+            if(!stopping) {
+                stopping = scan_spool();
+            }
+            s = next_task(&t);
+            if(s < 0) {
+                if(stopping && n_active == 0) {
+                    break;
+                }
+                usleep(SERVE_POLL);
+                continue;
+            }
+            failed = (mapped[s].serial != t.serial && open_slot(&jobs[s].files) != 0);
+            if(!failed) {
+                run_task(&t);
+            }
+            task_done(s, failed);
+        }
+
+    } else { //root scheduling the workers
+
+        printf("Serving %s on %d workers.\n", cfg_spool_dir, proc_n-1);
+        fflush(stdout);
+        pending = malloc(proc_n*TASKS_IN_FLIGHT*sizeof(int));
+        head = calloc(proc_n, sizeof(int));
+        queued = calloc(proc_n, sizeof(int));
+        known = calloc(proc_n*SERVE_JOBS, sizeof(int));
+        if(pending == NULL || head == NULL || queued == NULL || known == NULL) {
+            printf("malloc failed!\n");
+            exit(1);
+        }
+
+        while(1) {
+            if(!stopping) {
+                stopping = scan_spool();
+            }
+
+            //Tops up the queue of every worker, one task each at a time.
+            for(f=0; f<TASKS_IN_FLIGHT; f++) {
+                for(w=1; w<proc_n; w++) {
+                    if(queued[w] > f || (s = next_task(&t)) < 0) {
+                        continue;
+                    }
+                    if(known[w*SERVE_JOBS + s] != t.serial) {
+                        MPI_Send(&jobs[s].files, sizeof(job_files), MPI_BYTE, w, TAG_JOB,
+                                 MPI_COMM_WORLD);
+                        known[w*SERVE_JOBS + s] = t.serial;
+                    }
+                    MPI_Send(&t, sizeof(t), MPI_BYTE, w, TAG_TASK, MPI_COMM_WORLD);
+                    pending[w*TASKS_IN_FLIGHT + (head[w]+queued[w])%TASKS_IN_FLIGHT] = s;
+                    queued[w]++;
+                    outstanding++;
+                }
+            }
+
+            if(outstanding == 0) {
+                if(stopping && n_active == 0) {
+                    break;
+                }
+                usleep(SERVE_POLL);
+                continue;
+            }
+
+            //Tasks come back from each worker in the order they were sent,
+            //so the source of a notice tells which job it belongs to.
+            ts = trace_now();
+            MPI_Recv(&failed, 1, MPI_INT, MPI_ANY_SOURCE, TAG_RESULT, MPI_COMM_WORLD, &status);
+            trace_span(TRACE_WAIT, ts, status.MPI_SOURCE, 0);
+            w = status.MPI_SOURCE;
+            s = pending[w*TASKS_IN_FLIGHT + head[w]];
+            head[w] = (head[w]+1)%TASKS_IN_FLIGHT;
+            queued[w]--;
+            outstanding--;
+            task_done(s, failed);
+        }
+
+        for(w=1; w<proc_n; w++) {
+            MPI_Send(NULL, 0, MPI_INT, w, TAG_STOP, MPI_COMM_WORLD);
+        }
+        free(pending);
+        free(head);
+        free(queued);
+        free(known);
+    }
+
+    if(my_rank == 0) {
+        t2 = MPI_Wtime();
+        printf("Served %d jobs in %.2f seconds.\n", served, t2-t1);
+    }
+
+    for(s=0; s<SERVE_JOBS; s++) {
+        close_slot(&mapped[s]);
+    }
+    ws_free();
+
+    trace_write();
+    MPI_Finalize();
+    return 0;
+}
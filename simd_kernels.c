@@ -0,0 +1,305 @@
+/*
+SIMD variants of the leaf kernel micro-kernel and of the row sum used by
+msum(). Every function is compiled for its own instruction set through the
+target attribute, so a single binary carries all of them and kernel.c picks
+the best one supported by the node it is running on.
+
+The int32 variants are written with intrinsics. For the other element types
+(see ELEM_TYPE in mmulti.h) the variants are generated from GCC vector types
+(see VECTOR_VARIANTS()).
+
+All micro-kernels share the packed panel format of kernel.c: for each step of
+k, MR values of A followed by NR values of B. The MR x NR tile of C is kept in
+vector registers and only added to C once the whole kc depth was streamed.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mmulti.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+//The kernels below hardcode the register tile.
+#if MR != 4 || NR != 16
+#error "SIMD micro-kernels are written for a 4x16 register tile"
+#endif
+
+//Adds the first mr x nr elements of a full MR x NR tile to C.
+//Used by the vector kernels on the edges of the matrix.
+static void add_partial_tile(elem acc[MR][NR], elem *C, int ldc, int mr, int nr) {
+    int r, c;
+    for(r=0; r<mr; r++) {
+        for(c=0; c<nr; c++) {
+            C[r*ldc + c] += acc[r][c];
+        }
+    }
+}
+
+#if ELEM_TYPE == ELEM_INT32
+
+//====================================================================
+//SSE4.1: 4 lines x 4 vectors of 4 ints.
+__attribute__((target("sse4.1")))
+void micro_kernel_sse41(int kc, const int *Ap, const int *Bp,
+                        int *C, int ldc, int mr, int nr) {
+    __m128i acc[MR][NR/4];
+    int p, r, v;
+    for(r=0; r<MR; r++) {
+        for(v=0; v<NR/4; v++) {
+            acc[r][v] = _mm_setzero_si128();
+        }
+    }
+    for(p=0; p<kc; p++) {
+        __m128i b0 = _mm_loadu_si128((const __m128i *)&Bp[0]);
+        __m128i b1 = _mm_loadu_si128((const __m128i *)&Bp[4]);
+        __m128i b2 = _mm_loadu_si128((const __m128i *)&Bp[8]);
+        __m128i b3 = _mm_loadu_si128((const __m128i *)&Bp[12]);
+        for(r=0; r<MR; r++) {
+            __m128i a = _mm_set1_epi32(Ap[r]);
+            acc[r][0] = _mm_add_epi32(acc[r][0], _mm_mullo_epi32(a, b0));
+            acc[r][1] = _mm_add_epi32(acc[r][1], _mm_mullo_epi32(a, b1));
+            acc[r][2] = _mm_add_epi32(acc[r][2], _mm_mullo_epi32(a, b2));
+            acc[r][3] = _mm_add_epi32(acc[r][3], _mm_mullo_epi32(a, b3));
+        }
+        Ap += MR;
+        Bp += NR;
+    }
+    if(mr==MR && nr==NR) {
+        for(r=0; r<MR; r++) {
+            for(v=0; v<NR/4; v++) {
+                __m128i *c = (__m128i *)&C[r*ldc + v*4];
+                _mm_storeu_si128(c, _mm_add_epi32(_mm_loadu_si128(c), acc[r][v]));
+            }
+        }
+    } else {
+        int tile[MR][NR];
+        for(r=0; r<MR; r++) {
+            for(v=0; v<NR/4; v++) {
+                _mm_storeu_si128((__m128i *)&tile[r][v*4], acc[r][v]);
+            }
+        }
+        add_partial_tile(tile, C, ldc, mr, nr);
+    }
+}
+
+__attribute__((target("sse4.1")))
+void row_sum_sse41(const int *a, const int *b, int *c, int n) {
+    int j = 0;
+    for(; j+4<=n; j+=4) {
+        __m128i va = _mm_loadu_si128((const __m128i *)&a[j]);
+        __m128i vb = _mm_loadu_si128((const __m128i *)&b[j]);
+        _mm_storeu_si128((__m128i *)&c[j], _mm_add_epi32(va, vb));
+    }
+    for(; j<n; j++) {
+        c[j] = a[j] + b[j];
+    }
+}
+
+
+//====================================================================
+//AVX2: 4 lines x 2 vectors of 8 ints.
+__attribute__((target("avx2")))
+void micro_kernel_avx2(int kc, const int *Ap, const int *Bp,
+                       int *C, int ldc, int mr, int nr) {
+    __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256();
+    __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256();
+    __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256();
+    __m256i c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256();
+    int p;
+    for(p=0; p<kc; p++) {
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)&Bp[0]);
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)&Bp[8]);
+        __m256i a;
+        a = _mm256_set1_epi32(Ap[0]);
+        c00 = _mm256_add_epi32(c00, _mm256_mullo_epi32(a, b0));
+        c01 = _mm256_add_epi32(c01, _mm256_mullo_epi32(a, b1));
+        a = _mm256_set1_epi32(Ap[1]);
+        c10 = _mm256_add_epi32(c10, _mm256_mullo_epi32(a, b0));
+        c11 = _mm256_add_epi32(c11, _mm256_mullo_epi32(a, b1));
+        a = _mm256_set1_epi32(Ap[2]);
+        c20 = _mm256_add_epi32(c20, _mm256_mullo_epi32(a, b0));
+        c21 = _mm256_add_epi32(c21, _mm256_mullo_epi32(a, b1));
+        a = _mm256_set1_epi32(Ap[3]);
+        c30 = _mm256_add_epi32(c30, _mm256_mullo_epi32(a, b0));
+        c31 = _mm256_add_epi32(c31, _mm256_mullo_epi32(a, b1));
+        Ap += MR;
+        Bp += NR;
+    }
+    {
+        int tile[MR][NR];
+        int r, v;
+        _mm256_storeu_si256((__m256i *)&tile[0][0], c00);
+        _mm256_storeu_si256((__m256i *)&tile[0][8], c01);
+        _mm256_storeu_si256((__m256i *)&tile[1][0], c10);
+        _mm256_storeu_si256((__m256i *)&tile[1][8], c11);
+        _mm256_storeu_si256((__m256i *)&tile[2][0], c20);
+        _mm256_storeu_si256((__m256i *)&tile[2][8], c21);
+        _mm256_storeu_si256((__m256i *)&tile[3][0], c30);
+        _mm256_storeu_si256((__m256i *)&tile[3][8], c31);
+        if(mr==MR && nr==NR) {
+            for(r=0; r<MR; r++) {
+                for(v=0; v<NR; v+=8) {
+                    __m256i *c = (__m256i *)&C[r*ldc + v];
+                    __m256i t = _mm256_loadu_si256((const __m256i *)&tile[r][v]);
+                    _mm256_storeu_si256(c, _mm256_add_epi32(_mm256_loadu_si256(c), t));
+                }
+            }
+        } else {
+            add_partial_tile(tile, C, ldc, mr, nr);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void row_sum_avx2(const int *a, const int *b, int *c, int n) {
+    int j = 0;
+    for(; j+8<=n; j+=8) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)&a[j]);
+        __m256i vb = _mm256_loadu_si256((const __m256i *)&b[j]);
+        _mm256_storeu_si256((__m256i *)&c[j], _mm256_add_epi32(va, vb));
+    }
+    for(; j<n; j++) {
+        c[j] = a[j] + b[j];
+    }
+}
+
+
+//====================================================================
+//AVX-512: 4 lines x 1 vector of 16 ints. Edges use masked stores.
+__attribute__((target("avx512f")))
+void micro_kernel_avx512(int kc, const int *Ap, const int *Bp,
+                         int *C, int ldc, int mr, int nr) {
+    __m512i c0 = _mm512_setzero_si512();
+    __m512i c1 = _mm512_setzero_si512();
+    __m512i c2 = _mm512_setzero_si512();
+    __m512i c3 = _mm512_setzero_si512();
+    __mmask16 mask = (__mmask16)((1u<<nr) - 1);
+    __m512i acc[MR];
+    int p, r;
+    for(p=0; p<kc; p++) {
+        __m512i b = _mm512_loadu_si512((const void *)Bp);
+        c0 = _mm512_add_epi32(c0, _mm512_mullo_epi32(_mm512_set1_epi32(Ap[0]), b));
+        c1 = _mm512_add_epi32(c1, _mm512_mullo_epi32(_mm512_set1_epi32(Ap[1]), b));
+        c2 = _mm512_add_epi32(c2, _mm512_mullo_epi32(_mm512_set1_epi32(Ap[2]), b));
+        c3 = _mm512_add_epi32(c3, _mm512_mullo_epi32(_mm512_set1_epi32(Ap[3]), b));
+        Ap += MR;
+        Bp += NR;
+    }
+    acc[0] = c0;
+    acc[1] = c1;
+    acc[2] = c2;
+    acc[3] = c3;
+    for(r=0; r<mr; r++) {
+        int *c = &C[r*ldc];
+        __m512i old = _mm512_maskz_loadu_epi32(mask, c);
+        _mm512_mask_storeu_epi32(c, mask, _mm512_add_epi32(old, acc[r]));
+    }
+}
+
+__attribute__((target("avx512f")))
+void row_sum_avx512(const int *a, const int *b, int *c, int n) {
+    int j = 0;
+    for(; j+16<=n; j+=16) {
+        __m512i va = _mm512_loadu_si512((const void *)&a[j]);
+        __m512i vb = _mm512_loadu_si512((const void *)&b[j]);
+        _mm512_storeu_si512((void *)&c[j], _mm512_add_epi32(va, vb));
+    }
+    if(j<n) {
+        __mmask16 mask = (__mmask16)((1u<<(n-j)) - 1);
+        __m512i va = _mm512_maskz_loadu_epi32(mask, &a[j]);
+        __m512i vb = _mm512_maskz_loadu_epi32(mask, &b[j]);
+        _mm512_mask_storeu_epi32(&c[j], mask, _mm512_add_epi32(va, vb));
+    }
+}
+
+#else
+
+//====================================================================
+//Other element types: the same tile written with GCC vector types of the
+//register width of each instruction set, VECTOR_VARIANTS() stamping out the
+//micro-kernel and row sum of one of them. Lines of the tile are NR/lanes
+//vectors and the compiler picks the instructions for the element type.
+
+//Floating point variants also use the fused multiply-add of AVX2 nodes.
+#if ELEM_TYPE == ELEM_FLOAT || ELEM_TYPE == ELEM_DOUBLE
+#define AVX2_TARGET "avx2,fma"
+#else
+#define AVX2_TARGET "avx2"
+#endif
+
+#define VECTOR_VARIANTS(isa, target_isa, bytes)                             \
+typedef elem vec_##isa __attribute__((vector_size(bytes)));                 \
+enum { LANES_##isa = bytes/sizeof(elem), V_##isa = NR/LANES_##isa };        \
+                                                                            \
+__attribute__((target(target_isa)))                                         \
+void micro_kernel_##isa(int kc, const elem *Ap, const elem *Bp,             \
+                        elem *C, int ldc, int mr, int nr) {                 \
+    vec_##isa acc[MR][V_##isa];                                             \
+    vec_##isa b, c;                                                         \
+    elem tile[MR][NR];                                                      \
+    int p, r, v, l;                                                         \
+    _Pragma("GCC unroll 4")                                                 \
+    for(r=0; r<MR; r++) {                                                   \
+        _Pragma("GCC unroll 8")                                             \
+        for(v=0; v<V_##isa; v++) {                                          \
+            acc[r][v] = (vec_##isa){0};                                     \
+        }                                                                   \
+    }                                                                       \
+    for(p=0; p<kc; p++) {                                                   \
+        _Pragma("GCC unroll 8")                                             \
+        for(v=0; v<V_##isa; v++) {                                          \
+            memcpy(&b, &Bp[v*LANES_##isa], sizeof(b));                      \
+            _Pragma("GCC unroll 4")                                         \
+            for(r=0; r<MR; r++) {                                           \
+                acc[r][v] += Ap[r]*b;                                       \
+            }                                                               \
+        }                                                                   \
+        Ap += MR;                                                           \
+        Bp += NR;                                                           \
+    }                                                                       \
+    if(mr==MR && nr==NR) {                                                  \
+        _Pragma("GCC unroll 4")                                             \
+        for(r=0; r<MR; r++) {                                               \
+            _Pragma("GCC unroll 8")                                         \
+            for(v=0; v<V_##isa; v++) {                                      \
+                memcpy(&c, &C[r*ldc + v*LANES_##isa], sizeof(c));           \
+                c += acc[r][v];                                             \
+                memcpy(&C[r*ldc + v*LANES_##isa], &c, sizeof(c));           \
+            }                                                               \
+        }                                                                   \
+    } else {                                                                \
+        for(r=0; r<MR; r++) {                                               \
+            for(v=0; v<V_##isa; v++) {                                      \
+                for(l=0; l<LANES_##isa; l++) {                              \
+                    tile[r][v*LANES_##isa + l] = acc[r][v][l];              \
+                }                                                           \
+            }                                                               \
+        }                                                                   \
+        add_partial_tile(tile, C, ldc, mr, nr);                             \
+    }                                                                       \
+}                                                                           \
+                                                                            \
+__attribute__((target(target_isa)))                                         \
+void row_sum_##isa(const elem *a, const elem *b, elem *c, int n) {          \
+    vec_##isa va, vb;                                                       \
+    int j = 0;                                                              \
+    for(; j+LANES_##isa<=n; j+=LANES_##isa) {                               \
+        memcpy(&va, &a[j], sizeof(va));                                     \
+        memcpy(&vb, &b[j], sizeof(vb));                                     \
+        va += vb;                                                           \
+        memcpy(&c[j], &va, sizeof(va));                                     \
+    }                                                                       \
+    for(; j<n; j++) {                                                       \
+        c[j] = a[j] + b[j];                                                 \
+    }                                                                       \
+}
+
+VECTOR_VARIANTS(sse41, "sse4.1", 16)
+VECTOR_VARIANTS(avx2, AVX2_TARGET, 32)
+VECTOR_VARIANTS(avx512, "avx512f", 64)
+
+#endif
+
+#endif
@@ -0,0 +1,127 @@
+/*
+Strassen-Winograd variant of the divide and conquer multiplication.
+
+Each level performs 7 half size multiplications instead of 8, at the cost of
+15 additions of half size matrices:
+    S1 = A21 + A22    T1 = B12 - B11    P1 = A11*B11    P5 = S1*T1
+    S2 = S1  - A11    T2 = B22 - T1     P2 = A12*B21    P6 = S2*T2
+    S3 = A11 - A21    T3 = B22 - B12    P3 = S4*B22     P7 = S3*T3
+    S4 = A12 - S2     T4 = T2  - B21    P4 = A22*T4
+
+    C11 = P1 + P2
+    C12 = P1 + P6 + P5 + P3
+    C21 = P1 + P6 + P7 - P4
+    C22 = P1 + P6 + P7 + P5
+
+Below strassen_cutoff (or for odd dimensions) the classical leaf kernel is
+used, since there the extra additions cost more than the saved product.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mmulti.h"
+
+//Dimension at or below which strassen_multi() falls back to tiled_multi().
+int strassen_cutoff = STRASSEN_CUTOFF;
+
+
+//Z = X + sign*Y for n x n matrices with their own leading dimensions.
+//Z may be X or Y, which is how results get accumulated into a quadrant.
+void mat_addsub(const elem *X, int ldx, const elem *Y, int ldy,
+                elem *Z, int ldz, int n, int sign) {
+    int i, j;
+    for(i=0; i<n; i++) {
+        const elem *x = &X[i*ldx];
+        const elem *y = &Y[i*ldy];
+        elem *z = &Z[i*ldz];
+        if(sign > 0) {
+            row_sum(x, y, z, n);
+        } else {
+            for(j=0; j<n; j++) {
+                z[j] = x[j] - y[j];
+            }
+        }
+    }
+}
+
+//Copies the n x n block X into Z.
+void mat_copy(const elem *X, int ldx, elem *Z, int ldz, int n) {
+    int i;
+    for(i=0; i<n; i++) {
+        memcpy(&Z[i*ldz], &X[i*ldx], n*sizeof(elem));
+    }
+}
+
+/*
+Params:
+A = pointer to the top left element of the n x n operand A.
+lda = distance between two consecutive lines of A.
+B = pointer to the top left element of the n x n operand B.
+ldb = distance between two consecutive lines of B.
+C = pointer to the top left element of the n x n result.
+ldc = distance between two consecutive lines of C.
+Computes C = A*B. Only three half size temporaries are used per level, the
+quadrants of C hold the remaining partial results.
+*/
+void strassen_multi(const elem *A, int lda, const elem *B, int ldb,
+                    elem *C, int ldc, int n) {
+    if(n <= strassen_cutoff || n%2) {
+        tiled_multi(A, lda, B, ldb, C, ldc, n, n, n);
+        return;
+    }
+
+    int h = n/2;
+    const elem *A11 = A;
+    const elem *A12 = A + h;
+    const elem *A21 = A + h*lda;
+    const elem *A22 = A + h*lda + h;
+    const elem *B11 = B;
+    const elem *B12 = B + h;
+    const elem *B21 = B + h*ldb;
+    const elem *B22 = B + h*ldb + h;
+    elem *C11 = C;
+    elem *C12 = C + h;
+    elem *C21 = C + h*ldc;
+    elem *C22 = C + h*ldc + h;
+
+    if(ws_idle()) {
+        ws_reserve(strassen_workspace(n));
+    }
+    size_t mark = ws_mark();
+    elem *S = ws_alloc((size_t)h*h);
+    elem *T = ws_alloc((size_t)h*h);
+    elem *M = ws_alloc((size_t)h*h);
+
+    strassen_multi(A11, lda, B11, ldb, C11, ldc, h);     //C11 = P1
+
+    mat_addsub(A21, lda, A22, lda, S, h, h, 1);          //S1
+    mat_addsub(B12, ldb, B11, ldb, T, h, h, -1);         //T1
+    strassen_multi(S, h, T, h, C22, ldc, h);             //C22 = P5
+
+    mat_addsub(S, h, A11, lda, S, h, h, -1);             //S2
+    mat_addsub(B22, ldb, T, h, T, h, h, -1);             //T2
+    strassen_multi(S, h, T, h, M, h, h);                 //P6
+    mat_addsub(M, h, C11, ldc, M, h, h, 1);              //M = U2 = P1+P6
+
+    mat_addsub(A12, lda, S, h, S, h, h, -1);             //S4
+    strassen_multi(S, h, B22, ldb, C12, ldc, h);         //C12 = P3
+    mat_addsub(T, h, B21, ldb, T, h, h, -1);             //T4
+    strassen_multi(A22, lda, T, h, C21, ldc, h);         //C21 = P4
+
+    mat_addsub(C12, ldc, C22, ldc, C12, ldc, h, 1);      //C12 = P3+P5
+    mat_addsub(C12, ldc, M, h, C12, ldc, h, 1);          //C12 = U5
+    mat_addsub(M, h, C21, ldc, C21, ldc, h, -1);         //C21 = U2-P4
+    mat_addsub(M, h, C22, ldc, C22, ldc, h, 1);          //C22 = U2+P5
+
+    mat_addsub(A11, lda, A21, lda, S, h, h, -1);         //S3
+    mat_addsub(B22, ldb, B12, ldb, T, h, h, -1);         //T3
+    strassen_multi(S, h, T, h, M, h, h);                 //P7
+    mat_addsub(C21, ldc, M, h, C21, ldc, h, 1);          //C21 = U6
+    mat_addsub(C22, ldc, M, h, C22, ldc, h, 1);          //C22 = U7
+
+    strassen_multi(A12, lda, B21, ldb, M, h, h);         //P2
+    mat_addsub(C11, ldc, M, h, C11, ldc, h, 1);          //C11 = U1
+
+    ws_release(mark);
+}
@@ -11,6 +11,29 @@ required number of processes for n divisions is given by the recurrence
         { 1, n=0
 procs(n){
         { 1 + sum(7*proc(k)) ,0<=k<=n-1, n>1
+which amounts to 8^n processes.
+
+With STRASSEN_MODE set, every division performs the 7 products of the
+Strassen-Winograd variant instead of 8 (see strassen.c). The dividing process
+still keeps one product for itself and sends the other 6 away, together with
+the operands they need, since those are sums of quadrants of A and B that no
+other process holds. Only the root needs the original matrices in this mode.
+The same recurrence with 6 in place of 7 gives 7^n processes.
+
+With DISTRIBUTED_INPUT set, the classical tree also keeps the original
+matrices on the root only. Each job description is followed by the blocks of
+A and B the job needs, so the memory of a process grows with its share of
+the job instead of with the global size.
+
+With PLAN_REPEATS set, the multiplication is run that many times through a
+plan made once beforehand (see plan.c), the way an application looping on
+the same shapes would call it. The plan builds this same tree.
+
+The shape of the matrices and the number of divisions are read at runtime
+(see config.c). Matrices are padded with zeros to a square that can be
+halved that many times.
+Example use:
+    ladrun -np 64 strat_c_mmulti -n 8192 -d 2
 
 */
 
@@ -20,19 +43,68 @@ procs(n){
 #include "mpi.h"
 #include "mmulti.h"
 
-//Dimensions of matrices being multiplied
-//will be 2^MATRIX_DIM_EXP.
-#define MATRIX_DIM_EXP 13
+//Dimension of the matrices being multiplied, unless configured otherwise.
+#define DEFAULT_DIM (1<<13)
+
+//Divisions performed before conquering, unless configured otherwise.
+#define DEFAULT_DIVISIONS 2
+
+//Set to 1 to perform 7 products per division (Strassen-Winograd) instead of 8.
+#define STRASSEN_MODE 0
+
+//Set to 1 so that only the root holds the whole A and B, every other process
+//receiving from its father just the blocks its job needs.
+#define DISTRIBUTED_INPUT 0
+
+//Set to 1 to keep a single copy of A and B per node, in MPI-3 shared memory
+//filled by the first process of the node and read by all of them, instead
+//of one copy per process. Only used when the processes work on the
+//original matrices: neither STRASSEN_MODE, DISTRIBUTED_INPUT nor a plan.
+#define SHARED_INPUT 0
+
+//Set to a positive count to run the multiplication that many times through
+//one plan (see mm_plan_create()) instead of through the job descriptions
+//and process_recursion(). The time reported is that of one run, the plan
+//being made before the clock starts. Ignored in STRASSEN_MODE.
+#define PLAN_REPEATS 0
+
+//Whether the multiplication runs through a plan.
+#define PLANNED (PLAN_REPEATS > 0 && !STRASSEN_MODE)
+
+//Whether the processes read the original A and B.
+#define WHOLE_INPUT !(STRASSEN_MODE || DISTRIBUTED_INPUT || PLANNED)
 
-//This number defines how many divisions should be
-//performed before conquering.
-#define N_OF_DIVISIONS 2
+//Set to 1 to post the receives of the children products before the process
+//starts on its own piece and to reduce them in the order they arrive, or
+//to 0 to receive them one at a time in a fixed order through a single
+//buffer once the own piece is done.
+#define NONBLOCKING_COLLECT 1
 
-//Number of lines/colums of matrices being multiplied.
-#define MATRIX_DIM (1<<MATRIX_DIM_EXP)
+//Set to 1 to have the two children whose products go to the same quadrant
+//add them together before sending the sum to their father (see
+//pair_reduce()), which then receives 4 products instead of 7. Ignored in
+//STRASSEN_MODE and with RMA_RESULT.
+#define PAIR_REDUCTION 1
 
-//Matrices with this number of lines/colums should be conquered
-#define DELTA (1<<(MATRIX_DIM_EXP - N_OF_DIVISIONS))
+//Set to 1 to assemble the result with one-sided communication: the root
+//exposes its C as an RMA window and every leaf adds its product straight
+//into it (see result_window_open()), instead of sending it to its father to
+//be reduced and relayed level by level. Ignored in STRASSEN_MODE, whose
+//products each go to several quadrants, and with a plan.
+#define RMA_RESULT 0
+
+//Whether the result is assembled through the window.
+#define RMA_ASSEMBLY (RMA_RESULT && !STRASSEN_MODE && !PLANNED)
+
+//Whether siblings add their products together.
+#define PAIRED_SIBLINGS (PAIR_REDUCTION && !STRASSEN_MODE && !RMA_RESULT)
+
+//Number of products generated by each division.
+#if STRASSEN_MODE
+#define BRANCHING 7
+#else
+#define BRANCHING 8
+#endif
 
 
 //====================================================================
@@ -52,8 +124,21 @@ typedef struct {
 int my_rank;
 int proc_n;
 MPI_Status status;
-int *A;
-int *B;
+elem *A;
+elem *B;
+//Number of lines/colums of the (padded) matrices being multiplied.
+int matrix_dim;
+//Matrices with this number of lines/colums should be conquered.
+int delta;
+//Distance between two consecutive lines of the A and B this process holds:
+//the original matrices or the blocks received from the father.
+int ld_ab;
+//With RMA_RESULT, window of the result of the root.
+MPI_Win win_c;
+//Line of the whole A and colum of the whole B the blocks this process holds
+//start at, offsets of its jobs being relative to them. 0 unless the process
+//received its blocks from its father.
+int origin_l, origin_c;
 
 
 
@@ -64,10 +149,10 @@ void print_rec_str(recursion_struct *rec_str) {
 }
 
 //Calculates the number of required processes to perform
-//N_OF_DIVISIONS using this algorithm.
+//cfg_divisions using this algorithm.
 int required_procs_aux(int n);
 int required_procs() {
-    return required_procs_aux(N_OF_DIVISIONS);
+    return required_procs_aux(cfg_divisions);
 }
 int required_procs_aux(int n) {
     if(n==0)
@@ -76,41 +161,64 @@ int required_procs_aux(int n) {
     int i;
     int res = 1;
     for(i=0; i<n; i++) {
-        res += 7*required_procs_aux(i);
+        res += (BRANCHING-1)*required_procs_aux(i);
     }
     return res;
 }
 
+//Sends a job description to process dest followed, with DISTRIBUTED_INPUT,
+//by the blocks of A and B it refers to.
+void send_job(recursion_struct *job, int dest) {
+    //Offsets of the blocks sent are relative to ours, while the child
+    //places its result in C from those of the whole matrices.
+    recursion_struct sent = *job;
+    sent.al += origin_l;
+    sent.bc += origin_c;
+    double ts = trace_now();
+    MPI_Send (&sent, sizeof(recursion_struct), MPI_BYTE, dest, 1, MPI_COMM_WORLD);
+    trace_span(TRACE_SEND, ts, dest, sizeof(recursion_struct));
+    if(DISTRIBUTED_INPUT) {
+        send_block(&A[job->al*ld_ab + job->ac], ld_ab, job->dim, dest, 2);
+        send_block(&B[job->bl*ld_ab + job->bc], ld_ab, job->dim, dest, 2);
+    }
+}
+
 //Recursive function executed by every process.
 //Implements the divide and conquer method of matrix multiplication,
 //but ensures one of the eight pieces of the division stays with the dividing process.
-void process_recursion(recursion_struct *rec_ptr, int *C) {
-    
-    if(rec_ptr->dim <= DELTA) { //conquer
-        printf("[%d] conquering.\n", my_rank);
-        mmulti(A, B,
-               rec_ptr->al, rec_ptr->ac,
-               rec_ptr->bl, rec_ptr->bc,
-               C, rec_ptr->dim, MATRIX_DIM);
+//The result is written to C, whose lines are ldc elements apart, so the
+//piece kept by the process lands directly in the top left quadrant of its
+//father's C. Unless dest is -1, it is also streamed to process dest, panel
+//by panel as they are completed.
+void process_recursion(recursion_struct *rec_ptr, elem *C, int ldc, int dest) {
+    
+    if(rec_ptr->dim <= delta) { //conquer
+        double ts = trace_now();
+        parallel_multi(&A[rec_ptr->al*ld_ab + rec_ptr->ac], ld_ab,
+                       &B[rec_ptr->bl*ld_ab + rec_ptr->bc], ld_ab,
+                       C, ldc, rec_ptr->dim);
+        trace_span(TRACE_LEAF, ts, -1, 0);
+        if(RMA_ASSEMBLY) {
+            result_accumulate(C, ldc, rec_ptr->dim,
+                              (MPI_Aint)(origin_l + rec_ptr->al)*matrix_dim
+                              + origin_c + rec_ptr->bc, matrix_dim, win_c);
+        } else if(dest >= 0) {
+            send_result(C, ldc, rec_ptr->dim, dest);
+        }
         return;
     
     
     
     }// else divide
     
-    printf("[%d] dividing\n", my_rank);
     
     int half = rec_ptr->dim/2;
     int new_division = rec_ptr->division_n + 1;
-    int i;
-    int sum = 0;
-    //First children of the recursion can be calculated as
-    //summation(7^k) + myrank*7, where 0<=k<=current number
-    //of divides already performed at this point.
-    for(i=0; i <= rec_ptr->division_n; i++) {
-        sum += simple_pow(7, i);
-    }
-    int child1 = sum + my_rank*7;
+    //After k divisions processes 0 to 8^k - 1 are working, each of
+    //them spawning 7 new ones. First children of the recursion can
+    //then be calculated as 8^k + myrank*7, where k is the number of
+    //divides already performed at this point.
+    int child1 = simple_pow(8, rec_ptr->division_n) + my_rank*7;
     int child2 = child1+1;
     int child3 = child2+1;
     int child4 = child3+1;
@@ -136,81 +244,260 @@ void process_recursion(recursion_struct *rec_ptr, int *C) {
     //       my_rank, child1, child2, child3, child4, child5, child6, child7);
     
     //Sending jobs to other processes
-    MPI_Send (&A22B22_buffer, sizeof(recursion_struct), MPI_BYTE, child7, 1, MPI_COMM_WORLD);
-    MPI_Send (&A12B21_buffer, sizeof(recursion_struct), MPI_BYTE, child1, 1, MPI_COMM_WORLD);
-    MPI_Send (&A11B12_buffer, sizeof(recursion_struct), MPI_BYTE, child2, 1, MPI_COMM_WORLD);
-    MPI_Send (&A12B22_buffer, sizeof(recursion_struct), MPI_BYTE, child3, 1, MPI_COMM_WORLD);
-    MPI_Send (&A21B11_buffer, sizeof(recursion_struct), MPI_BYTE, child4, 1, MPI_COMM_WORLD);
-    MPI_Send (&A22B21_buffer, sizeof(recursion_struct), MPI_BYTE, child5, 1, MPI_COMM_WORLD);
-    MPI_Send (&A21B12_buffer, sizeof(recursion_struct), MPI_BYTE, child6, 1, MPI_COMM_WORLD);
-    //MPI_Send (&A22B22_buffer, sizeof(recursion_struct), MPI_BYTE, child7, 1, MPI_COMM_WORLD);
+    send_job(&A22B22_buffer, child7);
+    send_job(&A12B21_buffer, child1);
+    send_job(&A11B12_buffer, child2);
+    send_job(&A12B22_buffer, child3);
+    send_job(&A21B11_buffer, child4);
+    send_job(&A22B21_buffer, child5);
+    send_job(&A21B12_buffer, child6);
+    
+    //Every leaf adds its own product to the result of the root.
+    if(RMA_ASSEMBLY) {
+        process_recursion(&A11B11_buffer, C, ldc, -1);
+        return;
+    }
+    
+    //The other processes will give us all other matrices. Each one is
+    //reduced into its quadrant of C as soon as it is received: the first
+    //product of a quadrant is received straight into it, the second one is
+    //added. With PAIR_REDUCTION, children 2, 4 and 6 send the sum of their
+    //product and the one of the next child.
+    collector col;
+    collect_init(&col, C, ldc, half, NONBLOCKING_COLLECT);
+    collect_filled(&col, 0); //Our own A11B11
+    collect_target(&col, collect_expect(&col, child1), 0, 1); //A12B21
+    if(PAIRED_SIBLINGS) {
+        collect_target(&col, collect_expect(&col, child2), 1, 1); //A11B12 + A12B22
+        collect_target(&col, collect_expect(&col, child4), 2, 1); //A21B11 + A22B21
+        collect_target(&col, collect_expect(&col, child6), 3, 1); //A21B12 + A22B22
+    } else {
+        collect_target(&col, collect_expect(&col, child2), 1, 1); //A11B12
+        collect_target(&col, collect_expect(&col, child3), 1, 1); //A12B22
+        collect_target(&col, collect_expect(&col, child4), 2, 1); //A21B11
+        collect_target(&col, collect_expect(&col, child5), 2, 1); //A22B21
+        collect_target(&col, collect_expect(&col, child6), 3, 1); //A21B12
+        collect_target(&col, collect_expect(&col, child7), 3, 1); //A22B22
+    }
+    if(dest >= 0) {
+        collect_forward(&col, dest);
+    }
+    collect_start(&col);
     
     //The process still needs to take care of its own multiplication before joining results.
-    //Lets allocate the matrices that will hold the results to be summed;
-    int *A11B11;
-    int *A12B21;
-    int *A11B12;
-    int *A12B22;
-    int *A21B11;
-    int *A22B21;
-    int *A21B12;
-    int *A22B22;
-    
-    matrix_alloc(&A11B11, half);
-    matrix_alloc(&A12B21, half);
-    matrix_alloc(&A11B12, half);
-    matrix_alloc(&A12B22, half);
-    matrix_alloc(&A21B11, half);
-    matrix_alloc(&A22B21, half);
-    matrix_alloc(&A21B12, half);
-    matrix_alloc(&A22B22, half);
-    
-    //The recursion will give us A11B11.
-    process_recursion(&A11B11_buffer, A11B11);
-    //The other processes will give us all other matrices.
+    //The recursion will give us A11B11, written straight into C11.
+    process_recursion(&A11B11_buffer, C, ldc, -1);
+    
     //printf("[%d]Expecting matrices of dim %d\n", my_rank, half);
-    MPI_Recv (A12B21, half*half, MPI_INT, child1, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-    //printf("[%d] receives from child1[%d].\n", my_rank, child1);
-    MPI_Recv (A11B12, half*half, MPI_INT, child2, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-    //printf("[%d] receives from child2[%d].\n", my_rank, child2);
-    MPI_Recv (A12B22, half*half, MPI_INT, child3, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-    //printf("[%d] receives from child3[%d].\n", my_rank, child3);
-    MPI_Recv (A21B11, half*half, MPI_INT, child4, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-    //printf("[%d] receives from child4[%d].\n", my_rank, child4);
-    MPI_Recv (A22B21, half*half, MPI_INT, child5, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-    //printf("[%d] receives from child5[%d].\n", my_rank, child5);
-    MPI_Recv (A21B12, half*half, MPI_INT, child6, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-    //printf("[%d] receives from child6[%d].\n", my_rank, child6);
-    MPI_Recv (A22B22, half*half, MPI_INT, child7, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-    //printf("[%d] receives from child7[%d].\n", my_rank, child7);
-    
-    //Time to sum the multiplication results. Each sum will be stored in
-    //one quarter of the result matrix C.
-    msum(A11B11, A12B21, C,    0,    0, half); //C11
-    msum(A11B12, A12B22, C,    0, half, half); //C12
-    msum(A21B11, A22B21, C, half,    0, half); //C21
-    msum(A21B12, A22B22, C, half, half, half); //C22
-    
-    free(A11B11);
-    free(A12B21);
-    free(A11B12);
-    free(A12B22);
-    free(A21B11);
-    free(A22B21);
-    free(A21B12);
-    free(A22B22);
+    collect_finish(&col);
 }
 
 
 
-void main(int argc, char** argv) {
+//Workspace taken by process_recursion() for a job of dimension dim.
+//The first products of C12, C21 and C22 land in place, the four others
+//need a buffer.
+//Receive buffers of the non-blocking collection are held while the process
+//works on its own piece, the blocking one is only taken afterwards.
+//With RMA_RESULT nothing is collected, only the leaf of the own piece runs.
+size_t recursion_workspace(int dim) {
+    if(RMA_ASSEMBLY) {
+        return tiled_workspace(delta, delta, delta);
+    }
+    if(dim <= delta) {
+        return tiled_workspace(dim, dim, dim);
+    }
+    int half = dim/2;
+    size_t products = collect_workspace(half, PAIRED_SIBLINGS ? 1 : 4,
+                                        NONBLOCKING_COLLECT);
+    size_t own = recursion_workspace(half);
+    if(NONBLOCKING_COLLECT) {
+        return products + own;
+    }
+    return (products > own) ? products : own;
+}
+
+//Workspace taken by strassen_recursion() for a job of dimension dim.
+size_t strassen_recursion_workspace(int dim) {
+    if(dim <= delta) {
+        return strassen_workspace(dim);
+    }
+    int h = dim/2;
+    size_t operands = 2*ws_round((size_t)h*h);
+    size_t products = collect_workspace(h, 6, NONBLOCKING_COLLECT);
+    size_t own = strassen_recursion_workspace(h);
+    if(NONBLOCKING_COLLECT) {
+        own += products;
+    } else if(products > own) {
+        own = products;
+    }
+    return (operands > own) ? operands : own;
+}
+
+//Sends the operands X and Y of one Strassen product, preceded by the job
+//description, to process dest. Quadrants of A and B are sent in place.
+void send_strassen_job(recursion_struct *job,
+                       const elem *X, int ldx,
+                       const elem *Y, int ldy, int dest) {
+    double ts = trace_now();
+    MPI_Send (job, sizeof(recursion_struct), MPI_BYTE, dest, 1, MPI_COMM_WORLD);
+    trace_span(TRACE_SEND, ts, dest, sizeof(recursion_struct));
+    send_block(X, ldx, job->dim, dest, 2);
+    send_block(Y, ldy, job->dim, dest, 2);
+}
+
+//Distributed Strassen-Winograd recursion executed by every process when
+//STRASSEN_MODE is set. Ad and Bd are the dim x dim operands of this node
+//with their own leading dimensions: the original matrices on the root, the
+//operands received from the father on every other process. The result is
+//written to C, whose lines are ldc elements apart, and streamed to process
+//dest unless it is -1.
+void strassen_recursion(elem *Ad, int lda, elem *Bd, int ldb,
+                        elem *C, int ldc, int dim, int division_n, int dest) {
+    
+    if(dim <= delta) { //conquer
+        double ts = trace_now();
+        strassen_multi(Ad, lda, Bd, ldb, C, ldc, dim);
+        trace_span(TRACE_LEAF, ts, -1, 0);
+        if(dest >= 0) {
+            send_result(C, ldc, dim, dest);
+        }
+        return;
+    }// else divide
     
-    //A and B are square matrices of same size
-    matrix_alloc(&A, MATRIX_DIM);
-    matrix_alloc(&B, MATRIX_DIM);
+    
+    int h = dim/2;
+    elem *A11 = Ad;
+    elem *A12 = Ad + h;
+    elem *A21 = Ad + h*lda;
+    elem *A22 = Ad + h*lda + h;
+    elem *B11 = Bd;
+    elem *B12 = Bd + h;
+    elem *B21 = Bd + h*ldb;
+    elem *B22 = Bd + h*ldb + h;
+    elem *C11 = C;
+    elem *C12 = C + h;
+    elem *C21 = C + h*ldc;
+    elem *C22 = C + h*ldc + h;
+    
+    //After k divisions processes 0 to 7^k - 1 are working, each of
+    //them spawning 6 new ones.
+    int child1 = simple_pow(7, division_n) + my_rank*6;
+    int child2 = child1+1;
+    int child3 = child2+1;
+    int child4 = child3+1;
+    int child5 = child4+1;
+    int child6 = child5+1;
+    
+    recursion_struct job = {0, 0, 0, 0, h, division_n+1};
+    
+    //S and T hold the operands being built.
+    size_t mark = ws_mark();
+    elem *S = ws_alloc((size_t)h*h);
+    elem *T = ws_alloc((size_t)h*h);
+    
+    //Operands are built in an order that lets each one reuse the last.
+    mat_addsub(A21, lda, A22, lda, S, h, h, 1);          //S1
+    mat_addsub(B12, ldb, B11, ldb, T, h, h, -1);         //T1
+    send_strassen_job(&job, S, h, T, h, child4);         //P5 = S1*T1
+    mat_addsub(S, h, A11, lda, S, h, h, -1);             //S2
+    mat_addsub(B22, ldb, T, h, T, h, h, -1);             //T2
+    send_strassen_job(&job, S, h, T, h, child5);         //P6 = S2*T2
+    mat_addsub(A12, lda, S, h, S, h, h, -1);             //S4
+    send_strassen_job(&job, S, h, B22, ldb, child2);     //P3 = S4*B22
+    mat_addsub(T, h, B21, ldb, T, h, h, -1);             //T4
+    send_strassen_job(&job, A22, lda, T, h, child3);     //P4 = A22*T4
+    mat_addsub(A11, lda, A21, lda, S, h, h, -1);         //S3
+    mat_addsub(B22, ldb, B12, ldb, T, h, h, -1);         //T3
+    send_strassen_job(&job, S, h, T, h, child6);         //P7 = S3*T3
+    send_strassen_job(&job, A12, lda, B21, ldb, child1); //P2 = A12*B21
+    
+    ws_release(mark);
+    
+    //Each received product is added to the quadrants it takes part in.
+    //P1 = A11*B11 stays with this process and takes part in every quadrant.
+    collector col;
+    int p;
+    collect_init(&col, C, ldc, h, NONBLOCKING_COLLECT);
+    collect_filled(&col, 0);
+    collect_filled(&col, 1);
+    collect_filled(&col, 2);
+    collect_filled(&col, 3);
+    p = collect_expect(&col, child1); //P2
+    collect_target(&col, p, 0, 1);
+    p = collect_expect(&col, child2); //P3
+    collect_target(&col, p, 1, 1);
+    p = collect_expect(&col, child3); //P4
+    collect_target(&col, p, 2, -1);
+    p = collect_expect(&col, child4); //P5
+    collect_target(&col, p, 1, 1);
+    collect_target(&col, p, 3, 1);
+    p = collect_expect(&col, child5); //P6
+    collect_target(&col, p, 1, 1);
+    collect_target(&col, p, 2, 1);
+    collect_target(&col, p, 3, 1);
+    p = collect_expect(&col, child6); //P7
+    collect_target(&col, p, 2, 1);
+    collect_target(&col, p, 3, 1);
+    if(dest >= 0) {
+        collect_forward(&col, dest);
+    }
+    collect_start(&col);
+    
+    strassen_recursion(A11, lda, B11, ldb, C11, ldc, h, division_n+1, -1);
+    mat_copy(C11, ldc, C12, ldc, h);
+    mat_copy(C11, ldc, C21, ldc, h);
+    mat_copy(C11, ldc, C22, ldc, h);
+    
+    collect_finish(&col);
+}
+
+//Runs the multiplication PLAN_REPEATS times through a plan over every
+//process. Returns C on the root, NULL on the others. The clock of the root
+//restarts once the plan is made. The plan picks its own depth, which
+//replaces cfg_divisions so that the depth reported is the one that ran.
+elem *planned_multi(double *t1) {
+    elem *C = NULL;
+    mm_plan *plan;
+    int i;
+    if(my_rank == 0) {
+        matrix_alloc(&C, matrix_dim);
+    }
+    plan = mm_plan_create(matrix_dim, matrix_dim, matrix_dim, ELEM_TYPE,
+                          MPI_COMM_WORLD, MM_THREADS);
+    if(plan == NULL) {
+        exit(1);
+    }
+    if(plan->divisions != cfg_divisions) {
+        if(my_rank == 0) {
+            printf("The plan performs %d divisions instead of %d.\n",
+                   plan->divisions, cfg_divisions);
+        }
+        cfg_divisions = plan->divisions;
+    }
+    if(my_rank == 0) {
+        printf("Plan made in %.3f seconds, run %d times.\n", MPI_Wtime() - *t1,
+               PLAN_REPEATS);
+        *t1 = MPI_Wtime();
+    }
+    for(i=0; i<PLAN_REPEATS; i++) {
+        mm_execute(plan, A, B, C);
+    }
+    mm_plan_destroy(plan);
+    return C;
+}
+
+
+
+void main(int argc, char** argv) {
     
     //C points to the resulting matrix
-    int *C;
+    elem *C;
+    
+    //With RMA_RESULT, result of the root that every leaf adds its product
+    //to. C then only holds the leaf product of the process.
+    elem *C_all;
+    int ldc;
     
 	//These numbers store the current line and colum of the top left elements
 	//of the submatrices of A and B we are working with in the current level
@@ -228,18 +515,38 @@ void main(int argc, char** argv) {
 	
 	int half;
 	int father;
+	//Process this one streams its result to: its father, or with
+	//PAIR_REDUCTION the first of its pair of siblings. The first of a pair
+	//adds the result of its sibling (-1 if none) before sending it on.
+	int dest = -1;
+	int sibling = -1;
 	int child1, child2, child3, child4,
 	    child5, child6, child7, child8;
 	    
 	//For execution time measuring.
-	double t1, t2;
+	double t1 = 0, t2 = 0;
 	
 	int i;
 	
-    MPI_Init(&argc , &argv);
+	//Set on the processes that fill A and B, and windows of A and B with
+	//SHARED_INPUT.
+	int fill_ab = 0;
+	MPI_Win win_a, win_b;
+	
+	int provided; //Thread support given by MPI.
+	
+    //Only the main thread calls MPI, threads of parallel_multi() don't.
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
     MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
     MPI_Comm_size(MPI_COMM_WORLD, &proc_n);
     
+    if(config_init(argc, argv, DEFAULT_DIM, DEFAULT_DIVISIONS, my_rank != 0) != 0) {
+        exit(1);
+    }
+    matrix_dim = config_padded(1<<cfg_divisions);
+    delta = matrix_dim >> cfg_divisions;
+    ld_ab = matrix_dim;
+    
     
     //===========================================
     //Test if the number of processes is correct
@@ -248,7 +555,7 @@ void main(int argc, char** argv) {
         if(my_rank == 0) {
             int req_procs = 
             printf("Error. required number of processes to perform %d divisions is %d.\n",
-                   N_OF_DIVISIONS, p);
+                   cfg_divisions, p);
             printf("Number of processes given by the user: %d.\n", proc_n);
             printf("Aborting.\n");
         }
@@ -257,66 +564,148 @@ void main(int argc, char** argv) {
     //============================================
     //Test passed
     
+    trace_init();
+    
+    //A and B are square matrices of same size.
+    //In Strassen mode, or with distributed input, only the root works on
+    //the original matrices.
+    //With SHARED_INPUT, one copy per node is filled by the first process of
+    //the node.
+    if(SHARED_INPUT && WHOLE_INPUT) {
+        fill_ab = matrix_alloc_shared(&A, matrix_dim, matrix_dim, &win_a);
+        matrix_alloc_shared(&B, matrix_dim, matrix_dim, &win_b);
+    } else if(WHOLE_INPUT || my_rank == 0) {
+        matrix_alloc(&A, matrix_dim);
+        matrix_alloc(&B, matrix_dim);
+        fill_ab = 1;
+    }
+    if(fill_ab) {
+        block_init(A, matrix_dim, matrix_dim, cfg_m, cfg_k, 0, 0, 0);
+        block_init(B, matrix_dim, matrix_dim, cfg_k, cfg_n, 0, 0, 2);
+    }
+    if(SHARED_INPUT && WHOLE_INPUT) {
+        matrix_share(win_a);
+        matrix_share(win_b);
+    }
     
-    matrix_init(A, MATRIX_DIM, 0);
-    matrix_init(B, MATRIX_DIM, 2);
+    if(RMA_ASSEMBLY) {
+        result_window_open(&C_all, matrix_dim, &win_c);
+    }
     
-    printf("[%d]start\n", my_rank);
     
     
     
-    if ( my_rank != 0 ) { //not-root
+    if ( my_rank != 0 && !PLANNED ) { //not-root
         //Receive some division of the job
+        double ts = trace_now();
         MPI_Recv(&rec_str, sizeof(recursion_struct), MPI_BYTE, MPI_ANY_SOURCE, 1, MPI_COMM_WORLD, &status);
         father = status.MPI_SOURCE;
+        dest = father;
+        if(PAIRED_SIBLINGS) {
+            //Our position among the 7 children of our father: the second
+            //and third, the fourth and fifth, and the last two are pairs.
+            int child = my_rank - (simple_pow(8, rec_str.division_n-1) + father*7);
+            if(child > 0 && child%2) {
+                sibling = my_rank+1;
+                dest = -1;
+            } else if(child > 0) {
+                dest = my_rank-1;
+            }
+        }
+        trace_span(TRACE_RECV, ts, father, sizeof(recursion_struct));
+        if(STRASSEN_MODE || DISTRIBUTED_INPUT) {
+            //Operands of the product this process was given. Offsets in
+            //the description now refer to these blocks.
+            matrix_alloc(&A, rec_str.dim);
+            matrix_alloc(&B, rec_str.dim);
+            recv_block(A, rec_str.dim, rec_str.dim, father, 2);
+            recv_block(B, rec_str.dim, rec_str.dim, father, 2);
+            origin_l = rec_str.al;
+            origin_c = rec_str.bc;
+            rec_str.al = rec_str.ac = rec_str.bl = rec_str.bc = 0;
+            ld_ab = rec_str.dim;
+        }
         //printf("[%d] received from %d. Current dimensions of the matrices = %d\n",
         //       my_rank, father, rec_str.dim);
         //print_rec_str(&rec_str);
         C_dim = rec_str.dim;
         
-    } else { //root
-        printf("Dimensions of the matrices: %dx%d\n", MATRIX_DIM, MATRIX_DIM);
-        printf("Conquering point: %d\n", DELTA);
-        printf("Number of consecutive divisions to be performed before conquering: %d.\n", N_OF_DIVISIONS);
-        printf("number of processes: %d\n\n", proc_n);
+    } else if ( my_rank == 0 ) { //root
+        printf("Dimensions of the %s matrices: %dx%d times %dx%d, padded to %dx%d\n",
+               ELEM_NAME, cfg_m, cfg_k, cfg_k, cfg_n, matrix_dim, matrix_dim);
+        printf("Conquering point: %d\n", delta);
+        printf("Number of consecutive divisions to be performed before conquering: %d.\n", cfg_divisions);
+        printf("number of processes: %d\n", proc_n);
+        printf("Products per division: %d\n\n", BRANCHING);
         //printf("matrix A:\n");
-        //print_matrix(A, MATRIX_DIM);
+        //print_matrix(A, matrix_dim);
         //printf("\nmatrix B:\n");
-        //print_matrix(B, MATRIX_DIM);
+        //print_matrix(B, matrix_dim);
         rec_str.al = 0;
         rec_str.ac = 0;
         rec_str.bl = 0;
         rec_str.bc = 0;
-        rec_str.dim = MATRIX_DIM;
+        rec_str.dim = matrix_dim;
         rec_str.division_n = 0;
-        C_dim = MATRIX_DIM;
+        C_dim = matrix_dim;
         t1 = MPI_Wtime();
     }
     
     
     
     //Start computation.
-    //Allocate matrix to hold results.
-    matrix_alloc(&C, C_dim);
-    process_recursion(&rec_str, C);
+    if(PLANNED) {
+        C = planned_multi(&t1);
+    } else {
+        //Allocate matrix to hold results.
+        ldc = RMA_ASSEMBLY ? delta : C_dim;
+        matrix_alloc(&C, ldc);
+        //The workspace arena is sized once for the whole recursion.
+        if(STRASSEN_MODE) {
+            ws_reserve(strassen_recursion_workspace(C_dim));
+            //Operands of every process have exactly C_dim colums.
+            strassen_recursion(A, C_dim, B, C_dim, C, C_dim, C_dim, rec_str.division_n,
+                               (my_rank != 0) ? father : -1);
+        } else {
+            ws_reserve(recursion_workspace(C_dim));
+            process_recursion(&rec_str, C, ldc, dest);
+            if(sibling >= 0) {
+                ws_reserve(pair_workspace(C_dim));
+                pair_reduce(C, C_dim, sibling, father);
+            }
+        }
+        if(RMA_ASSEMBLY) {
+            result_window_close(&win_c);
+            if(my_rank == 0) {
+                free(C);
+                C = C_all;
+            }
+        }
+    }
     
     
     
-    if(my_rank!=0) { //not-root
-        //Non-root nodes still need to send back their results
-        //printf("[%d]Sending back matrix of dim %d\n", my_rank, C_dim);
-        //print_matrix(C, C_dim);
-        MPI_Send(C, C_dim*C_dim, MPI_INT, father, 1, MPI_COMM_WORLD);
-        
-    } else { //root
+    //Non-root nodes sent back their results while computing them.
+    if(my_rank==0) { //root
         t2 = MPI_Wtime();
-        //print_matrix(C, MATRIX_DIM);
+#if PLANNED
+        //Time of a single run.
+        t2 = t1 + (t2 - t1)/PLAN_REPEATS;
+#endif
+        //print_matrix(C, matrix_dim);
         printf("Time taken: %.2f\n", t2-t1);
     }
     
     free(C);
+    ws_free();
+    if(SHARED_INPUT && WHOLE_INPUT) {
+        matrix_free_shared(&win_a);
+        matrix_free_shared(&win_b);
+    }
+    
     
-    printf("[%d]done.\n", my_rank);
+    config_report("strat_c_mmulti", t2-t1);
+    trace_write();
     
     MPI_Finalize();
 }
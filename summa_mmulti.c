@@ -0,0 +1,287 @@
+//Example use:
+//ladrun -np 64 summa_mmulti -n 8192
+//ladrun -np 64 summa_mmulti -a a.mat -b b.mat -o c.mat
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mpi.h"
+#include "mmulti.h"
+
+/*
+SUMMA multiplication on a grid of processes, with optional 2.5D replication.
+
+The processes form REPLICATION layers of q x q processes. Process (i, j) of
+every layer holds the blocks A(i,j), B(i,j) and C(i,j) of a q x q split of
+the matrices, each of them b = S/q lines/colums. S is the largest dimension
+of the shape read at runtime (see config.c), padded with zeros up to a
+multiple of q.
+
+C(i,j) is the sum over k of A(i,k)*B(k,j). At step k, process (i, k)
+broadcasts A(i,k) along its line of the grid and process (k, j) broadcasts
+B(k,j) along its colum, then every process accumulates their product into
+its C block with the leaf kernel. The broadcasts of step k+1 are posted
+before the product of step k starts, so they travel while it computes.
+
+With REPLICATION c > 1, layer 0 generates A and B and copies its blocks to
+the other layers. Each layer then does q/c of the q steps and the partial
+C blocks are summed back on layer 0. Every process then sends about 1/sqrt(c)
+of what it would send on a single layer, for c times the memory.
+
+The number of processes must be c*q*q, q being a multiple of c. For
+instance:
+    c   q   processes
+    1   8   64
+    2   8   128
+    4   4   64
+
+C stays split among the processes of layer 0. Set GATHER_RESULT to collect
+it on the root.
+
+A and B can also be read from matrix files (-a, -b), the shape then being
+theirs, and C written to one (-o). Every process of layer 0 reads its
+blocks and writes its block of C itself, with collective MPI-IO calls
+(see matfile.c), so the result goes to disk without any gather.
+*/
+
+//Dimension of the matrices being multiplied, unless configured otherwise.
+#define DEFAULT_DIM (1<<13)
+
+//Number of layers the grid is replicated on (1 for plain 2D SUMMA).
+#define REPLICATION 1
+
+//Set to 1 to assemble the whole C on the root at the end.
+#define GATHER_RESULT 0
+
+
+//Blocks of A and B held by this process.
+elem *A;
+elem *B;
+
+//Blocks of A and B received for the current step and for the next one.
+elem *A_buf[2];
+elem *B_buf[2];
+
+int b; //Lines/colums of the blocks.
+int layer, gi, gj; //Position of this process in the grid.
+
+MPI_Comm row_comm; //Processes of the same layer and line of the grid.
+MPI_Comm col_comm; //Processes of the same layer and colum.
+MPI_Comm fiber_comm; //Processes holding the same blocks in every layer.
+
+//Matrix files of A, B and C, when given.
+matrix_file fa;
+matrix_file fb;
+matrix_file fc;
+
+
+//Posts the broadcasts of the blocks of step k through slot s of the
+//buffers. Ak and Bk get the blocks to multiply once req completes: the
+//process owning a block broadcasts it straight from where it lives.
+void post_step(int k, int s, elem **Ak, elem **Bk, MPI_Request *req) {
+    *Ak = (gj == k) ? A : A_buf[s];
+    *Bk = (gi == k) ? B : B_buf[s];
+    MPI_Ibcast(*Ak, b*b, MPI_ELEM, k, row_comm, &req[0]);
+    MPI_Ibcast(*Bk, b*b, MPI_ELEM, k, col_comm, &req[1]);
+}
+
+
+int main(int argc, char** argv) {
+
+    //Block of C computed by this process.
+    elem *C;
+
+    //Blocks of A and B of the current step and of the next one.
+    elem *Ak[2];
+    elem *Bk[2];
+    MPI_Request req[2][2];
+
+    //The whole C, on the root with GATHER_RESULT.
+    elem *C_all;
+
+    int q; //Lines/colums of the grid.
+    int matrix_dim; //Lines/colums of the padded matrices.
+    int first, last; //Steps done by this layer.
+    int k, cur, src;
+
+    //For execution time measuring.
+    double t1 = 0, t2 = 0, ts;
+
+    int provided; //Thread support given by MPI.
+    int my_rank; //Process id.
+    int proc_n; //Total number of processes
+    //Only the main thread calls MPI.
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &proc_n);
+
+    if(config_init(argc, argv, DEFAULT_DIM, 0, my_rank != 0) != 0) {
+        exit(1);
+    }
+    if((cfg_a_file == NULL) != (cfg_b_file == NULL)) {
+        if(my_rank == 0) {
+            printf("Both -a and -b are needed to read the operands from files.\n");
+        }
+        exit(1);
+    }
+    if(cfg_a_file != NULL) {
+        if(mfile_popen(&fa, cfg_a_file, 0, MPI_COMM_WORLD) != 0
+           || mfile_popen(&fb, cfg_b_file, 0, MPI_COMM_WORLD) != 0) {
+            exit(1);
+        }
+        if(fa.cols != fb.rows) {
+            if(my_rank == 0) {
+                printf("%s and %s can't be multiplied: %dx%d times %dx%d.\n",
+                       cfg_a_file, cfg_b_file, fa.rows, fa.cols, fb.rows, fb.cols);
+            }
+            exit(1);
+        }
+        cfg_m = fa.rows;
+        cfg_k = fa.cols;
+        cfg_n = fb.cols;
+    }
+
+    //===========================================
+    //Test if the number of processes is correct
+    q = 1;
+    while((q+1)*(q+1)*REPLICATION <= proc_n) {
+        q++;
+    }
+    if(q*q*REPLICATION != proc_n || q%REPLICATION != 0) {
+        if(my_rank == 0) {
+            printf("Error. %d processes can't form %d layers of q x q processes,\n",
+                   proc_n, REPLICATION);
+            printf("q being a multiple of %d.\n", REPLICATION);
+            printf("Aborting.\n");
+        }
+        exit(1);
+    }
+    //============================================
+    //Test passed
+
+    trace_init();
+
+    matrix_dim = config_padded(q);
+    b = matrix_dim/q;
+    layer = my_rank/(q*q);
+    gi = (my_rank%(q*q))/q;
+    gj = my_rank%q;
+    first = layer*(q/REPLICATION);
+    last = first + q/REPLICATION;
+
+    //Ranks in row_comm and col_comm are the colum and line in the grid,
+    //ranks in fiber_comm are the layer.
+    MPI_Comm_split(MPI_COMM_WORLD, layer*q + gi, gj, &row_comm);
+    MPI_Comm_split(MPI_COMM_WORLD, layer*q + gj, gi, &col_comm);
+    MPI_Comm_split(MPI_COMM_WORLD, gi*q + gj, layer, &fiber_comm);
+
+    matrix_alloc(&A, b);
+    matrix_alloc(&B, b);
+    matrix_alloc(&C, b);
+    matrix_alloc(&A_buf[0], b);
+    matrix_alloc(&A_buf[1], b);
+    matrix_alloc(&B_buf[0], b);
+    matrix_alloc(&B_buf[1], b);
+    memset(C, 0, (size_t)b*b*sizeof(elem));
+    ws_reserve(tiled_workspace(b, b, b));
+
+    if(cfg_a_file != NULL) {
+        //Collective: the other layers take part reading nothing.
+        mfile_read_all(&fa, A, b, gi*b, gj*b, layer == 0 ? b : 0, b);
+        mfile_read_all(&fb, B, b, gi*b, gj*b, layer == 0 ? b : 0, b);
+        mfile_pclose(&fa);
+        mfile_pclose(&fb);
+    } else if(layer == 0) {
+        block_init(A, b, b, cfg_m, cfg_k, gi*b, gj*b, 0);
+        block_init(B, b, b, cfg_k, cfg_n, gi*b, gj*b, 2);
+    }
+
+
+    if(my_rank == 0) {
+        printf("Dimensions of the %s matrices: %dx%d times %dx%d, padded to %dx%d\n",
+               ELEM_NAME, cfg_m, cfg_k, cfg_k, cfg_n, matrix_dim, matrix_dim);
+        printf("Grid: %d layers of %dx%d processes, blocks of %dx%d\n",
+               REPLICATION, q, q, b, b);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    t1 = MPI_Wtime();
+
+    //Copies of the blocks of layer 0 for the other layers.
+    if(REPLICATION > 1) {
+        MPI_Bcast(A, b*b, MPI_ELEM, 0, fiber_comm);
+        MPI_Bcast(B, b*b, MPI_ELEM, 0, fiber_comm);
+    }
+
+    post_step(first, 0, &Ak[0], &Bk[0], req[0]);
+    for(k=first; k<last; k++) {
+        cur = (k-first)%2;
+        if(k+1 < last) {
+            post_step(k+1, 1-cur, &Ak[1-cur], &Bk[1-cur], req[1-cur]);
+        }
+        ts = trace_now();
+        MPI_Waitall(2, req[cur], MPI_STATUSES_IGNORE);
+        trace_span(TRACE_WAIT, ts, -1, 2*(long)b*b*sizeof(elem));
+        ts = trace_now();
+        tiled_multi_acc(Ak[cur], b, Bk[cur], b, C, b, b, b, b);
+        trace_span(TRACE_LEAF, ts, -1, 0);
+    }
+
+    //Partial results of the layers are summed on layer 0.
+    if(REPLICATION > 1) {
+        ts = trace_now();
+        if(layer == 0) {
+            MPI_Reduce(MPI_IN_PLACE, C, b*b, MPI_ELEM, MPI_SUM, 0, fiber_comm);
+        } else {
+            MPI_Reduce(C, NULL, b*b, MPI_ELEM, MPI_SUM, 0, fiber_comm);
+        }
+        trace_span(TRACE_MSUM, ts, -1, (long)b*b*sizeof(elem));
+    }
+
+    if(cfg_c_file != NULL) {
+        if(mfile_pcreate(&fc, cfg_c_file, cfg_m, cfg_n,
+                         cfg_a_file != NULL ? fa.tile : MFILE_TILE, MPI_COMM_WORLD) != 0) {
+            exit(1);
+        }
+        mfile_write_all(&fc, C, b, gi*b, gj*b, layer == 0 ? b : 0, b);
+        mfile_pclose(&fc);
+    }
+
+    if(GATHER_RESULT && layer == 0) {
+        if(my_rank == 0) {
+            matrix_alloc(&C_all, matrix_dim);
+            mat_copy(C, b, C_all, matrix_dim, b);
+            for(src=1; src<q*q; src++) {
+                recv_block(&C_all[(src/q)*b*matrix_dim + (src%q)*b], matrix_dim,
+                           b, src, 1);
+            }
+            //print_matrix(C_all, matrix_dim);
+            free(C_all);
+        } else {
+            MPI_Send(C, b*b, MPI_ELEM, 0, 1, MPI_COMM_WORLD);
+        }
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    if(my_rank == 0) {
+        t2 = MPI_Wtime();
+        printf("Time taken: %.2f\n", t2-t1);
+    }
+
+    free(A);
+    free(B);
+    free(C);
+    free(A_buf[0]);
+    free(A_buf[1]);
+    free(B_buf[0]);
+    free(B_buf[1]);
+    ws_free();
+    MPI_Comm_free(&row_comm);
+    MPI_Comm_free(&col_comm);
+    MPI_Comm_free(&fiber_comm);
+
+
+    config_report("summa_mmulti", t2-t1);
+    trace_write();
+    MPI_Finalize();
+    return 0;
+}
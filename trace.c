@@ -0,0 +1,227 @@
+/*
+Per process timeline of where the time goes, for tuning the trees.
+
+When a trace file is configured (-t FILE, see config.c), every process
+records timestamped spans of its hot paths into a ring buffer held in
+memory: messages sent, messages received, waits on pending receives, leaf
+computations, reductions of products (msum), allocations and writes of
+results to files (io). Nothing is printed while the multiplication runs. At
+the end, trace_write() gathers every buffer on the root, which writes them
+as a Chrome trace (JSON "trace event" format, read by chrome://tracing and
+ui.perfetto.dev) with one track per process, and prints how long the
+busiest and idlest process spent in every kind of span.
+
+Typical use:
+    double t = trace_now();
+    MPI_Send(...);
+    trace_span(TRACE_SEND, t, dest, bytes);
+
+Without a trace file, trace_now() and trace_span() return at once. Only the
+thread calling MPI records spans: the other threads of parallel_multi() do
+nothing but leaf work, which is already covered by the span around it.
+Clocks of the processes are aligned by a barrier in trace_init(), which is
+as close as MPI_Wtime() allows on clusters without a global clock.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mpi.h"
+#include "mmulti.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//Spans kept by every process. The oldest ones are overwritten once the
+//buffer is full, totals still count them.
+#define TRACE_EVENTS (1<<16)
+
+//Tag of the buffers sent to the root by trace_write().
+#define TRACE_TAG 9999
+
+typedef struct {
+    double start;
+    double end;
+    int kind;
+    int peer;                           //Other process, or -1
+    long bytes;
+} trace_event;
+
+static char *kind_names[TRACE_KINDS] = {"send", "recv", "wait", "leaf",
+                                        "msum", "alloc", "io"};
+
+int trace_on = 0;
+static trace_event *events;
+static long n_events;                   //Spans recorded, overwritten included
+static double origin;                   //MPI_Wtime() at the barrier
+static double totals[TRACE_KINDS];
+
+
+//Allocates the buffer and aligns the clocks. Collective over
+//MPI_COMM_WORLD, to be called by every process once configured.
+void trace_init() {
+    if(cfg_trace_file == NULL) {
+        return;
+    }
+    events = malloc(TRACE_EVENTS*sizeof(trace_event));
+    if(events == NULL) {
+        printf("malloc failed!\n");
+        exit(1);
+    }
+    n_events = 0;
+    memset(totals, 0, sizeof(totals));
+    MPI_Barrier(MPI_COMM_WORLD);
+    origin = MPI_Wtime();
+    trace_on = 1;
+}
+
+//Start of a span, or 0 when not tracing.
+double trace_now() {
+    if(!trace_on) {
+        return 0;
+    }
+#ifdef _OPENMP
+    if(omp_get_thread_num() != 0) {
+        return 0;
+    }
+#endif
+    return MPI_Wtime();
+}
+
+//Records a span of the given kind from start to now. peer is the process
+//on the other end of a message, or -1, and bytes its size.
+void trace_span(int kind, double start, int peer, long bytes) {
+    trace_event *e;
+    double end;
+    if(!trace_on) {
+        return;
+    }
+#ifdef _OPENMP
+    if(omp_get_thread_num() != 0) {
+        return;
+    }
+#endif
+    end = MPI_Wtime();
+    e = &events[n_events%TRACE_EVENTS];
+    e->start = start;
+    e->end = end;
+    e->kind = kind;
+    e->peer = peer;
+    e->bytes = bytes;
+    n_events++;
+    totals[kind] += end - start;
+}
+
+//Writes the n spans of process rank to f, starting at first in the ring.
+static void write_events(FILE *f, trace_event *ev, long n, long first, int rank,
+                         int *written) {
+    long i;
+    for(i=0; i<n; i++) {
+        trace_event *e = &ev[(first + i)%TRACE_EVENTS];
+        fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": 0, "
+                "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"peer\": %d, \"bytes\": %ld}}",
+                (*written)++ ? ",\n" : "", kind_names[e->kind], rank,
+                (e->start - origin)*1e6, (e->end - e->start)*1e6, e->peer, e->bytes);
+    }
+}
+
+//Gathers the spans of every process into the trace file and prints the
+//time spent in every kind of span by the busiest and the idlest process.
+//Collective over MPI_COMM_WORLD.
+void trace_write() {
+    double min[TRACE_KINDS], max[TRACE_KINDS], sum[TRACE_KINDS];
+    long n, first, dropped;
+    int my_rank, proc_n, src, k;
+    int written = 0;
+    trace_event *ev;
+    FILE *f = NULL;
+    MPI_Status st;
+
+    if(cfg_trace_file == NULL) {
+        return;
+    }
+    trace_on = 0;
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &proc_n);
+    n = (n_events < TRACE_EVENTS) ? n_events : TRACE_EVENTS;
+    first = n_events - n;
+    dropped = first;
+
+    //Local clocks: every span is sent relative to this process's origin.
+    for(k=0; k<n; k++) {
+        ev = &events[(first + k)%TRACE_EVENTS];
+        ev->start -= origin;
+        ev->end -= origin;
+    }
+    origin = 0;
+
+    MPI_Reduce(totals, min, TRACE_KINDS, MPI_DOUBLE, MPI_MIN, 0, MPI_COMM_WORLD);
+    MPI_Reduce(totals, max, TRACE_KINDS, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(totals, sum, TRACE_KINDS, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    if(my_rank == 0) {
+        MPI_Reduce(MPI_IN_PLACE, &dropped, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    } else {
+        MPI_Reduce(&dropped, NULL, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    }
+
+    if(my_rank != 0) {
+        //Oldest span first: the ring is sent unrolled.
+        MPI_Send(&n, 1, MPI_LONG, 0, TRACE_TAG, MPI_COMM_WORLD);
+        if(first%TRACE_EVENTS + n > TRACE_EVENTS) {
+            long head = TRACE_EVENTS - first%TRACE_EVENTS;
+            MPI_Send(&events[first%TRACE_EVENTS], head*sizeof(trace_event), MPI_BYTE,
+                     0, TRACE_TAG, MPI_COMM_WORLD);
+            MPI_Send(events, (n - head)*sizeof(trace_event), MPI_BYTE,
+                     0, TRACE_TAG, MPI_COMM_WORLD);
+        } else {
+            MPI_Send(&events[first%TRACE_EVENTS], n*sizeof(trace_event), MPI_BYTE,
+                     0, TRACE_TAG, MPI_COMM_WORLD);
+            MPI_Send(events, 0, MPI_BYTE, 0, TRACE_TAG, MPI_COMM_WORLD);
+        }
+        free(events);
+        return;
+    }
+
+    f = fopen(cfg_trace_file, "w");
+    if(f == NULL) {
+        printf("Can't write the trace to %s.\n", cfg_trace_file);
+    } else {
+        fprintf(f, "{\"traceEvents\": [\n");
+        for(src=0; src<proc_n; src++) {
+            fprintf(f, "%s{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+                    "\"args\": {\"name\": \"rank %d\"}}",
+                    written++ ? ",\n" : "", src, src);
+        }
+        write_events(f, events, n, first, 0, &written);
+    }
+    //Buffers of the other processes go through the root's one, which is
+    //written already.
+    for(src=1; src<proc_n; src++) {
+        int got;
+        MPI_Recv(&n, 1, MPI_LONG, src, TRACE_TAG, MPI_COMM_WORLD, &st);
+        MPI_Recv(events, n*sizeof(trace_event), MPI_BYTE, src, TRACE_TAG,
+                 MPI_COMM_WORLD, &st);
+        MPI_Get_count(&st, MPI_BYTE, &got);
+        MPI_Recv((char *)events + got, n*sizeof(trace_event) - got, MPI_BYTE, src,
+                 TRACE_TAG, MPI_COMM_WORLD, &st);
+        if(f != NULL) {
+            write_events(f, events, n, 0, src, &written);
+        }
+    }
+    if(f != NULL) {
+        fprintf(f, "\n]}\n");
+        fclose(f);
+        printf("Trace of %d processes written to %s", proc_n, cfg_trace_file);
+        if(dropped > 0) {
+            printf(", %ld oldest spans dropped", dropped);
+        }
+        printf(".\n");
+    }
+    free(events);
+
+    printf("%-6s %12s %12s %12s\n", "span", "min (s)", "mean (s)", "max (s)");
+    for(k=0; k<TRACE_KINDS; k++) {
+        printf("%-6s %12.6f %12.6f %12.6f\n", kind_names[k], min[k], sum[k]/proc_n, max[k]);
+    }
+}
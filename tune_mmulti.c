@@ -0,0 +1,282 @@
+//Example use:
+//ladrun -np 73 tune_mmulti -n 8192
+//MMULTI_PROFILE=/shared/nodeA.tune ladrun -np 2 tune_mmulti
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mpi.h"
+#include "mmulti.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+Autotuner writing the tuning profile of a node type (see
+config_load_profile()), which every driver and bench_mmulti load at startup.
+
+The root times the leaf kernel and the recursions on this node, one setting
+after the other, each time keeping the fastest value:
+    1. micro-kernel variant, among those the node supports;
+    2. cache blocking of the leaf kernel, MC then KC then NC;
+    3. leaf cutoff of mmulti(), as called by the drivers: parallel_multi()
+       with OMP_NUM_THREADS threads, mmulti() with a single one;
+    4. cutoff of the Strassen-Winograd recursion.
+Dimensions above TUNE_DIM are not timed, the rate measured at TUNE_DIM
+standing for them.
+
+With two processes or more, it also picks the number of divisions of the
+tree drivers for N x N matrices (-n, default DEFAULT_DIM). The first two
+processes measure the latency and bandwidth between them. Every depth the
+processes allow is then estimated as the leaf computation of one N/2^d
+block plus the collection of the 8 products of every level, the root
+waiting on the deepest path. Run it with as many processes as the real runs
+will use, spread over the nodes the same way. With a single process the
+profile leaves the divisions to the drivers.
+*/
+
+//Dimension of the matrices the divisions are picked for, unless
+//configured otherwise.
+#define DEFAULT_DIM (1<<13)
+
+//Largest dimension timed.
+#define TUNE_DIM 1024
+
+//Every candidate is run once untimed, then this many times, the best time
+//being kept.
+#define TUNE_REPS 3
+
+//Size of the message timing the bandwidth, in bytes.
+#define PING_BYTES (8<<20)
+
+//What is timed.
+enum { T_TILED, T_LEAF, T_STRASSEN };
+
+elem *A;
+elem *B;
+elem *C;
+
+
+//Threads parallel_multi() runs on.
+int leaf_threads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+//Best time of TUNE_REPS runs of routine r on s x s matrices.
+double best_time(int r, int s) {
+    double t, best = 0;
+    int i;
+    ws_free();
+    for(i=0; i<=TUNE_REPS; i++) {
+        t = MPI_Wtime();
+        switch(r) {
+        case T_TILED:
+            tiled_multi(A, s, B, s, C, s, s, s, s);
+            break;
+        case T_LEAF:
+            //What the drivers call on their leaves.
+            if(leaf_threads() > 1) {
+                parallel_multi(A, s, B, s, C, s, s);
+            } else {
+                mmulti(A, B, 0, 0, 0, 0, C, s, s);
+            }
+            break;
+        case T_STRASSEN:
+            strassen_multi(A, s, B, s, C, s, s);
+            break;
+        }
+        t = MPI_Wtime() - t;
+        if(i == 1 || (i > 1 && t < best)) {
+            best = t;
+        }
+    }
+    return best;
+}
+
+//Sets *setting to every candidate in turn, keeping the fastest one for
+//routine r on s x s matrices.
+void tune(char *name, int *setting, int *candidates, int n, int r, int s) {
+    double t, best = 0;
+    int i, pick = *setting;
+    for(i=0; i<n; i++) {
+        *setting = candidates[i];
+        t = best_time(r, s);
+        printf("  %-16s %6d %10.2f GOPS\n", name, candidates[i],
+               2.0*s*s*(double)s/t*1e-9);
+        if(i == 0 || t < best) {
+            best = t;
+            pick = candidates[i];
+        }
+    }
+    *setting = pick;
+    printf("%s: %d\n", name, pick);
+}
+
+//Processes mpi_mmulti needs for d divisions.
+int tree_procs(int d) {
+    int i, p = 0;
+    for(i=0; i<=d; i++) {
+        p += simple_pow(8, i);
+    }
+    return p;
+}
+
+//Times messages of 1 byte and of PING_BYTES between the first two
+//processes. Both return, on the root, the one way latency and bandwidth.
+void ping_pong(int my_rank, double *latency, double *bandwidth) {
+    char *buf = malloc(PING_BYTES);
+    int sizes[2] = {1, PING_BYTES};
+    double t[2];
+    int i, j;
+    MPI_Status st;
+    if(buf == NULL) {
+        printf("malloc failed!\n");
+        exit(1);
+    }
+    memset(buf, 0, PING_BYTES);
+    for(j=0; j<2; j++) {
+        t[j] = MPI_Wtime();
+        for(i=0; i<=TUNE_REPS; i++) {
+            if(i == 1) {
+                t[j] = MPI_Wtime();
+            }
+            if(my_rank == 0) {
+                MPI_Send(buf, sizes[j], MPI_BYTE, 1, 1, MPI_COMM_WORLD);
+                MPI_Recv(buf, sizes[j], MPI_BYTE, 1, 1, MPI_COMM_WORLD, &st);
+            } else {
+                MPI_Recv(buf, sizes[j], MPI_BYTE, 0, 1, MPI_COMM_WORLD, &st);
+                MPI_Send(buf, sizes[j], MPI_BYTE, 0, 1, MPI_COMM_WORLD);
+            }
+        }
+        t[j] = (MPI_Wtime() - t[j])/(2*TUNE_REPS);
+    }
+    *latency = t[0];
+    *bandwidth = PING_BYTES/(t[1] - t[0]);
+    free(buf);
+}
+
+//Estimated time of the tree with d divisions for N x N matrices, given the
+//leaf rate in operations per second and the link between processes.
+double tree_estimate(int N, int d, double rate, double latency, double bandwidth) {
+    double s = (double)(N >> d);
+    double t = 2*s*s*s/rate;
+    int l;
+    for(l=1; l<=d; l++) {
+        double h = (double)(N >> l);
+        t += 8*(latency + h*h*sizeof(elem)/bandwidth);
+    }
+    return t;
+}
+
+
+int main(int argc, char** argv) {
+    int kernels[KERNEL_COUNT];
+    int mcs[] = {32, 64, 128, 256, 512};
+    int kcs[] = {64, 128, 256, 512, 1024};
+    int ncs[] = {256, 512, 1024, 2048, 4096};
+    int cutoffs[16];
+    int n_kernels = 0, n_cutoffs = 0;
+    int kernel, pick = 0, s, c, d, N;
+    int divisions = -1;
+    double latency, bandwidth, rate, t, best = 0;
+
+    int provided; //Thread support given by MPI.
+    int my_rank; //Process id.
+    int proc_n; //Total number of processes
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &proc_n);
+
+    if(config_init(argc, argv, DEFAULT_DIM, 0, my_rank != 0) != 0) {
+        exit(1);
+    }
+    N = config_padded(1);
+
+    if(proc_n > 1 && my_rank < 2) {
+        ping_pong(my_rank, &latency, &bandwidth);
+    }
+
+    if(my_rank == 0) {
+        //Start over from the built-in settings, not from the old profile.
+        tile_mc = MC_DEFAULT;
+        tile_kc = KC_DEFAULT;
+        tile_nc = NC_DEFAULT;
+        mmulti_cutoff = MMULTI_CUTOFF;
+        strassen_cutoff = STRASSEN_CUTOFF;
+
+        s = TUNE_DIM;
+        while(s > N && s > 64) {
+            s /= 2;
+        }
+        matrix_alloc(&A, s);
+        matrix_alloc(&B, s);
+        matrix_alloc(&C, s);
+        matrix_init(A, s, 0);
+        matrix_init(B, s, 2);
+        printf("Tuning for %s matrices on %dx%d blocks, %d threads.\n",
+               ELEM_NAME, s, s, leaf_threads());
+
+        for(kernel=0; kernel<KERNEL_COUNT; kernel++) {
+            if(kernel_supported(kernel)) {
+                kernels[n_kernels++] = kernel;
+            }
+        }
+        for(kernel=0; kernel<n_kernels; kernel++) {
+            kernel_select(kernels[kernel]);
+            t = best_time(T_TILED, s);
+            printf("  %-16s %6s %10.2f GOPS\n", "kernel", kernel_name(kernels[kernel]),
+                   2.0*s*s*(double)s/t*1e-9);
+            if(kernel == 0 || t < best) {
+                best = t;
+                pick = kernels[kernel];
+            }
+        }
+        kernel_select(pick);
+        printf("kernel: %s\n", kernel_name(pick));
+
+        tune("mc", &tile_mc, mcs, 5, T_TILED, s);
+        tune("kc", &tile_kc, kcs, 5, T_TILED, s);
+        tune("nc", &tile_nc, ncs, 5, T_TILED, s);
+
+        for(c=16; c<=s; c*=2) {
+            cutoffs[n_cutoffs++] = c;
+        }
+        tune("cutoff", &mmulti_cutoff, cutoffs, n_cutoffs, T_LEAF, s);
+        tune("strassen_cutoff", &strassen_cutoff, cutoffs, n_cutoffs, T_STRASSEN, s);
+
+        if(proc_n > 1) {
+            printf("Link between processes 0 and 1: %.1f us, %.2f GB/s\n",
+                   latency*1e6, bandwidth*1e-9);
+            for(d=0; tree_procs(d) <= proc_n && (N >> d) >= 2; d++) {
+                //Leaf blocks larger than the tuning block run at its rate.
+                int leaf = ((N >> d) < s) ? (N >> d) : s;
+                rate = 2.0*leaf*leaf*(double)leaf/best_time(T_LEAF, leaf);
+                t = tree_estimate(N, d, rate, latency, bandwidth);
+                printf("  %-16s %6d %10.3f s estimated for %dx%d on %d processes\n",
+                       "divisions", d, t, N, N, tree_procs(d));
+                if(d == 0 || t < best) {
+                    best = t;
+                    divisions = d;
+                }
+            }
+            printf("divisions: %d (%d processes for mpi_mmulti, %d for strat_c_mmulti)\n",
+                   divisions, tree_procs(divisions), simple_pow(8, divisions));
+        }
+
+        if(config_save_profile(divisions) == 0) {
+            printf("Profile written to %s\n", config_profile_path());
+        }
+        free(A);
+        free(B);
+        free(C);
+        ws_free();
+    }
+
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,167 @@
+/*
+Workspace arena for the temporaries of the recursions.
+
+One block of memory is reserved up front, sized from the top level dimension
+and the depth of the recursion, and every level takes stack-like slices of it:
+    size_t mark = ws_mark();
+    elem *T = ws_alloc(n*n);
+    ...
+    ws_release(mark);
+This replaces the malloc/free pairs every recursion node used to do. Since
+slices are released in the opposite order they were taken, the arena never
+fragments and the peak usage is known before the computation starts.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "mmulti.h"
+
+//Every thread has its own arena, so the tasks of parallel_multi() never
+//share slices. Arenas of the other threads are reserved the first time their
+//leaf kernel runs and kept for the next calls.
+static _Thread_local elem *ws_base = NULL;
+static _Thread_local size_t ws_size = 0; //Capacity, in elements
+static _Thread_local size_t ws_top = 0;  //Elements currently handed out
+
+
+//Elements in a 64 byte line.
+#define WS_LINE (64/sizeof(elem))
+
+//Slices are rounded up to whole 64 byte lines so every one of them stays
+//aligned for the SIMD kernels.
+size_t ws_round(size_t n) {
+    return (n + WS_LINE-1) & ~(size_t)(WS_LINE-1);
+}
+
+
+//Makes sure the arena holds at least n elements. The arena can only be resized
+//while nothing is allocated from it, so this must be called before the
+//computation starts. Entry points such as mmulti() call it themselves when
+//they are the first to use the arena.
+void ws_reserve(size_t n) {
+    if(n <= ws_size) {
+        return;
+    }
+    if(ws_top != 0) {
+        printf("workspace can't grow while in use!\n");
+        exit(1);
+    }
+    double ts = trace_now();
+    free(ws_base);
+    n = ws_round(n);
+    ws_base = aligned_alloc(64, n*sizeof(elem));
+    if(ws_base==NULL) {
+        printf("malloc failed!\n");
+        exit(1);
+    }
+    ws_size = n;
+    trace_span(TRACE_ALLOC, ts, -1, (long)n*sizeof(elem));
+}
+
+//Hands out n elements from the top of the arena.
+elem *ws_alloc(size_t n) {
+    elem *ptr;
+    n = ws_round(n);
+    if(ws_top + n > ws_size) {
+        printf("workspace exhausted!\n");
+        exit(1);
+    }
+    ptr = ws_base + ws_top;
+    ws_top += n;
+    return ptr;
+}
+
+//Current top of the arena, to be given back to ws_release().
+size_t ws_mark() {
+    return ws_top;
+}
+
+//Releases every slice handed out after mark was taken.
+void ws_release(size_t mark) {
+    ws_top = mark;
+}
+
+//Tells whether nothing is currently allocated from the arena, that is,
+//whether the caller is the outermost user of it.
+int ws_idle() {
+    return ws_top == 0;
+}
+
+void ws_free() {
+    free(ws_base);
+    ws_base = NULL;
+    ws_size = 0;
+    ws_top = 0;
+}
+
+
+//====================================================================
+//Workspace needed by each routine, in elements.
+
+//Packed panels of tiled_multi().
+size_t tiled_workspace(int m, int n, int k) {
+    size_t mc = (tile_mc < m) ? tile_mc : m;
+    size_t kc = (tile_kc < k) ? tile_kc : k;
+    size_t nc = (tile_nc < n) ? tile_nc : n;
+    return ws_round((mc+MR-1)/MR*MR*kc) + ws_round((nc+NR-1)/NR*NR*kc);
+}
+
+//mmulti() accumulates in place, only its leaf kernel needs workspace.
+size_t mmulti_workspace(int s) {
+    if(mmulti_strassen) {
+        return strassen_workspace(s);
+    }
+    while(s > mmulti_cutoff && s > 2 && s%2 == 0) {
+        s /= 2;
+    }
+    return (s <= mmulti_cutoff || s > 2) ? tiled_workspace(s, s, s) : 0;
+}
+
+//Three half size temporaries per level of strassen_multi().
+size_t strassen_workspace(int n) {
+    size_t total = 0;
+    while(n > strassen_cutoff && n%2 == 0) {
+        n /= 2;
+        total += 3*ws_round((size_t)n*n);
+    }
+    return total + tiled_workspace(n, n, n);
+}
+
+
+//====================================================================
+//Memory high-water mark of the process, for the benchmarks.
+
+//Restarts the high-water mark from the memory currently in use, so the
+//next mem_peak_kib() covers what happened since. Linux only: elsewhere the
+//mark keeps covering the whole life of the process.
+void mem_peak_reset() {
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if(f != NULL) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+//Largest resident memory of the process since it started or since the
+//last mem_peak_reset(), in KiB.
+long mem_peak_kib() {
+    struct rusage ru;
+    char line[128];
+    long kib = -1;
+    FILE *f = fopen("/proc/self/status", "r");
+    if(f != NULL) {
+        while(fgets(line, sizeof(line), f) != NULL) {
+            if(sscanf(line, "VmHWM: %ld", &kib) == 1) {
+                break;
+            }
+        }
+        fclose(f);
+    }
+    if(kib < 0) {
+        getrusage(RUSAGE_SELF, &ru);
+        kib = ru.ru_maxrss;
+    }
+    return kib;
+}